@@ -17,6 +17,13 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "imps.h"
 
 // #defines used for determining and executing instructions
 #define UINT16_MASK 0xFFFF
@@ -71,6 +78,7 @@
 // #defines for syscalls
 #define SYSCALL_1 1
 #define SYSCALL_4 4
+#define SYSCALL_9 9
 #define SYSCALL_10 10
 #define SYSCALL_11 11
 #define SYSCALL_12 12
@@ -85,6 +93,8 @@
 #define A0 4
 #define A1 5
 #define A2 6
+#define GP 28
+#define SP 29
 #define MEMORY_START 0x10010000
 #define BYTE_LEN 1
 #define HALF_WORD_LEN 2
@@ -93,7 +103,170 @@
 #define MAX_FILE_SIZE 128
 #define MAX_FILE_NUM 6
 #define MAX_DESC_NUM 8 
-
+#define IMPS_MESSAGE_LEN 128
+#define INT32_DECIMAL_LEN 12
+#define BATCH_MAX_WORKERS 256
+#define BATCH_OUTPUT_LEN 4096
+#define BATCH_OUTPUT_MAX (64 * 1024 * 1024)
+#define OUTPUT_BUFFER_LEN (64 * 1024)
+#define MEMORY_PADDING (2 * WORD_LEN)
+#define GUARD_RESERVATION ((size_t)UINT32_MAX + 1)
+#define GUARD_DATA_SIZE 0x10000
+#define GUEST_PAGE_SHIFT 12
+#define GUEST_PAGE_SIZE (1 << GUEST_PAGE_SHIFT)
+#define PAGE_TABLE_SHIFT 22
+#define PAGE_TABLE_LEN 1024
+#define TLB_LEN 64
+#define TLB_SIZES 3
+#define MAX_PATH_LEN UINT16_MAX
+#define HEAP_START 0x10040000
+#define HEAP_MAX_SIZE 0x40000000
+#define HEAP_CHUNK 0x100000
+#define STACK_TOP 0x80000000
+#define STACK_DEFAULT_SIZE 0x800000
+#define STACK_MIN_SIZE 0x10000
+#define STACK_MAX_SIZE 0x20000000
+#define STACK_POINTER_START 0x7FFFEFFC
+#define GLOBAL_POINTER_START 0x10008000
+
+// Threaded dispatch relies on the labels-as-values extension of GCC and Clang.
+// Build with -DIMPS_NO_THREADED to use the portable switch loop instead.
+#if defined(__GNUC__) && !defined(IMPS_NO_THREADED)
+#define IMPS_THREADED 1
+#endif
+
+// Used on the few functions that are called once per executed instruction.
+#if defined(__GNUC__)
+#define IMPS_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define IMPS_ALWAYS_INLINE inline
+#endif
+
+// The JIT emits x86-64 machine code into an mmap'd buffer, so it is only 
+// built for x86-64 unix hosts. Build with -DIMPS_NO_JIT to leave it out.
+// The buffer is a shared memory object, mapped once to write and once to 
+// run.
+#if defined(__x86_64__) && defined(__unix__) && !defined(IMPS_NO_JIT)
+#define IMPS_JIT 1
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+// Hot blocks are compiled on a background thread so the guest keeps running
+// while they compile. Build with -DIMPS_NO_JIT_THREAD to compile them on the
+// spot instead.
+#if defined(IMPS_JIT) && !defined(IMPS_NO_JIT_THREAD)
+#define IMPS_JIT_THREAD 1
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+// The zero-copy loader and the translation cache map files into memory, so 
+// they are only built for unix hosts. Build with -DIMPS_NO_MMAP to read 
+// executables with stdio instead, or with -DIMPS_NO_CACHE to leave the cache
+// out. The cache is a command line option, so the library never has it.
+#if defined(__unix__) && !defined(IMPS_NO_MMAP)
+#define IMPS_MMAP 1
+#include <sys/stat.h>
+#if !defined(IMPS_NO_CACHE) && !defined(IMPS_LIBRARY)
+#define IMPS_CACHE 1
+#endif
+#endif
+
+#if defined(IMPS_JIT) || defined(IMPS_MMAP)
+#include <sys/mman.h>
+#endif
+
+// Guard page memory reserves the whole 32 bit guest address space around the
+// data segment and leaves everything outside it inaccessible, so a bad 
+// address faults in the host and SIGSEGV turns the fault back into the usual
+// error. It needs a 64 bit unix host. Build with -DIMPS_GUARD_MEMORY to use
+// it instead of checking every address.
+#if defined(IMPS_GUARD_MEMORY)
+#if !defined(IMPS_MMAP) || UINTPTR_MAX <= UINT32_MAX
+#error "IMPS_GUARD_MEMORY needs mmap and a 64 bit host"
+#endif
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+// On unix hosts guest output on the command line is written to stdout with
+// write(2) rather than through stdio. unistd.h declares a syscall function 
+// of its own, which is renamed out of the way.
+#if defined(__unix__)
+#define IMPS_WRITE 1
+#define syscall host_syscall
+#include <unistd.h>
+#undef syscall
+#endif
+
+// --batch runs jobs on a pool of POSIX threads, so it is only built into the
+// command line on unix hosts. Build with -DIMPS_NO_BATCH to leave it out.
+#if defined(__unix__) && !defined(IMPS_NO_BATCH) && !defined(IMPS_LIBRARY)
+#define IMPS_BATCH 1
+#include <pthread.h>
+#endif
+
+// Superinstructions generated by --profile. The generated file defines
+// GENERATED_SUPERINSTRUCTIONS(X), calling X once per superinstruction with
+// its name, length and the handlers of its parts (NONE after the last part).
+// Build with -DIMPS_SUPERINSTRUCTIONS='"file.h"' to include them.
+#ifdef IMPS_SUPERINSTRUCTIONS
+#include IMPS_SUPERINSTRUCTIONS
+#else
+#define GENERATED_SUPERINSTRUCTIONS(X)
+#endif
+
+// #defines for block execution
+#define BLOCK_FALLTHROUGH 0
+#define BLOCK_TAKEN 1
+#define BLOCK_EXITS 2
+
+// #defines for tiered execution. Blocks start out interpreted, move to the
+// threaded tier after TIER_THREADED_AFTER executions and are compiled by the
+// JIT after TIER_JIT_AFTER. Both can be changed on the command line.
+#define TIER_INTERPRETED 0
+#define TIER_THREADED 1
+#define TIER_COMPILING 2
+#define TIER_NATIVE 3
+#define TIER_THREADED_AFTER 2
+#define TIER_JIT_AFTER 100
+
+// #defines for the JIT
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_BLOCK_LEN 64
+#define JIT_MAX_BLOCK_BYTES 16384
+#define JIT_MAX_FIXUPS 3
+#define JIT_INTERPRET ((uint64_t)1 << 32)
+#define JIT_EXIT_SHIFT 33
+#define JIT_QUEUE_SIZE 256
+#define JIT_PROLOGUE_LEN 19
+#define JIT_JMP_LEN 5
+#define JIT_EXIT_SKIP 18
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+// #defines for --profile
+#define PROFILE_MODE 2
+#define PROFILE_MIN_LENGTH 2
+#define PROFILE_MAX_LENGTH 4
+#define PROFILE_HANDLER_BITS 5
+#define PROFILE_HANDLER_MASK ((1 << PROFILE_HANDLER_BITS) - 1)
+#define PROFILE_REPORT_LEN 20
+#define PROFILE_MAX_FUSED 16
+
+// #defines for emitting C
+#define EMIT_C_BYTES_PER_LINE 16
+
+// #defines for the translation cache. Bump CACHE_FORMAT whenever the layout
+// of a cache file or of struct decoded_inst changes.
+#define IMPS_VERSION "1.1"
+#define CACHE_FORMAT 2
+#define CACHE_MAGIC "IMPC"
+#define CACHE_MAGIC_SIZE 4
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325
+#define FNV_PRIME 0x100000001B3
 
 // Do not rename or modify this struct! It's directly used
 // by the subset 1 autotests.
@@ -107,6 +280,159 @@ struct imps_file {
     uint8_t *initial_data;
 };
 
+// Handler ids used by the predecoded instruction stream. Every instruction is
+// mapped to one of these once at load time so the execution loop never has to
+// look at the raw bit pattern again.
+enum inst_handler {
+    HANDLER_BAD,
+    HANDLER_ADDI,
+    HANDLER_ORI,
+    HANDLER_LUI,
+    HANDLER_ADDIU,
+    HANDLER_MUL,
+    HANDLER_BEQ,
+    HANDLER_BNE,
+    HANDLER_SYSCALL,
+    HANDLER_ADD,
+    HANDLER_CLO,
+    HANDLER_CLZ,
+    HANDLER_ADDU,
+    HANDLER_SLT,
+    HANDLER_LB,
+    HANDLER_LH,
+    HANDLER_LW,
+    HANDLER_SB,
+    HANDLER_SH,
+    HANDLER_SW,
+    // Sentinel after the last instruction, reached by running off the end or
+    // by a branch that leaves the instructions.
+    HANDLER_PAST_END,
+    // Never executed, fills the unused parts of a superinstruction pattern.
+    HANDLER_NONE,
+    // Superinstructions, each running an instruction and the one after it.
+    // Only the first instruction of the pair is replaced, the second keeps
+    // its own handler so it can still be jumped to on its own.
+    HANDLER_LUI_ORI,
+    HANDLER_SLT_BEQ,
+    HANDLER_SLT_BNE,
+    HANDLER_ADDI_BNE,
+    // Superinstructions generated by --profile.
+#define FUSED_ENUM(name, length, a, b, c, d) HANDLER_##name,
+    GENERATED_SUPERINSTRUCTIONS(FUSED_ENUM)
+#undef FUSED_ENUM
+};
+
+#ifndef IMPS_LIBRARY
+// Names of the plain instruction handlers, used by --profile.
+static const char *const handler_names[] = {
+    [HANDLER_BAD] = "bad",
+    [HANDLER_ADDI] = "addi",
+    [HANDLER_ORI] = "ori",
+    [HANDLER_LUI] = "lui",
+    [HANDLER_ADDIU] = "addiu",
+    [HANDLER_MUL] = "mul",
+    [HANDLER_BEQ] = "beq",
+    [HANDLER_BNE] = "bne",
+    [HANDLER_SYSCALL] = "syscall",
+    [HANDLER_ADD] = "add",
+    [HANDLER_CLO] = "clo",
+    [HANDLER_CLZ] = "clz",
+    [HANDLER_ADDU] = "addu",
+    [HANDLER_SLT] = "slt",
+    [HANDLER_LB] = "lb",
+    [HANDLER_LH] = "lh",
+    [HANDLER_LW] = "lw",
+    [HANDLER_SB] = "sb",
+    [HANDLER_SH] = "sh",
+    [HANDLER_SW] = "sw"
+};
+#endif
+
+// A generated superinstruction and the handlers it replaces.
+struct fused_pattern {
+    uint8_t handler;
+    uint8_t length;
+    uint8_t parts[PROFILE_MAX_LENGTH];
+};
+
+// Runs the part of a generated superinstruction at 'offset'. Only branches
+// can end a generated superinstruction, so syscall and bad have none.
+#define FUSED_PART_ADDI(offset) add_i_inst(inst + offset, data)
+#define FUSED_PART_ORI(offset) ori_inst(inst + offset, data)
+#define FUSED_PART_LUI(offset) lui_inst(inst + offset, data)
+#define FUSED_PART_ADDIU(offset) addiu_inst(inst + offset, data)
+#define FUSED_PART_MUL(offset) mul_inst(inst + offset, data)
+#define FUSED_PART_BEQ(offset) beq_inst(inst + offset, data)
+#define FUSED_PART_BNE(offset) bne_inst(inst + offset, data)
+#define FUSED_PART_ADD(offset) add_inst(inst + offset, data)
+#define FUSED_PART_CLO(offset) clo_inst(inst + offset, data)
+#define FUSED_PART_CLZ(offset) clz_inst(inst + offset, data)
+#define FUSED_PART_ADDU(offset) addu_inst(inst + offset, data)
+#define FUSED_PART_SLT(offset) slt_inst(inst + offset, data)
+#define FUSED_PART_LB(offset) lb_inst(inst + offset, data, executable)
+#define FUSED_PART_LH(offset) lh_inst(inst + offset, data, executable)
+#define FUSED_PART_LW(offset) lw_inst(inst + offset, data, executable)
+#define FUSED_PART_SB(offset) sb_inst(inst + offset, data, executable)
+#define FUSED_PART_SH(offset) sh_inst(inst + offset, data, executable)
+#define FUSED_PART_SW(offset) sw_inst(inst + offset, data, executable)
+#define FUSED_PART_NONE(offset) (void)(offset)
+
+// A single decoded instruction. Register fields are already extracted and the
+// immediate is already extended (sign extended for arithmetic, branches and
+// memory offsets, zero extended for ori, pre-shifted for lui). For a bad
+// instruction the immediate holds the raw instruction for the error message.
+struct decoded_inst {
+    uint8_t handler;
+    uint8_t source;
+    uint8_t target;
+    uint8_t destination;
+    uint32_t immediate;
+};
+
+// Predecoded instructions of a loaded executable. When the executable was 
+// mapped rather than read, its arrays point into 'mapping', and so does 
+// 'code' if it came from the translation cache.
+struct loaded_image {
+    struct decoded_inst *code;
+    uint8_t *mapping;
+    size_t mapping_size;
+    bool cached;
+};
+
+// Start of a translation cache file. It is followed by the predecoded
+// instructions and their sentinel, the raw instructions, the debug offsets
+// and the initial data, all in host byte order.
+struct cache_header {
+    uint8_t magic[CACHE_MAGIC_SIZE];
+    uint32_t format;
+    uint64_t key;
+    uint32_t num_instructions;
+    uint32_t entry_point;
+    uint32_t memory_size;
+    uint32_t reserved;
+};
+
+#ifndef IMPS_GUARD_MEMORY
+// The second level of the guest page table, covering 4 MiB of addresses. 
+// Pages that are NULL have never been written.
+struct page_table {
+    uint8_t *pages[PAGE_TABLE_LEN];
+};
+
+// A software TLB entry mapping the guest page at 'base' to 'page'. Entries
+// are direct mapped by page number. 'limits' holds how many byte, half and
+// word accesses from the start of the page are valid, which is less than a
+// page's worth only at the end of the data segment. Rotating an access's 
+// offset from 'base' right by log2 of its size turns an address outside the
+// page or a misaligned one into a large number, so one compare against its
+// limit checks the page, the range and the alignment.
+struct tlb_entry {
+    uint32_t base;
+    uint16_t limits[TLB_SIZES];
+    uint8_t *page;
+};
+#endif
+
 // Used to keep track of all registers, a previous iteration of all 
 // registers before an instruction and the index to determine which 
 // instruction the program is up to.
@@ -116,6 +442,119 @@ struct runtime_data {
     // used for trace mode to check for any changes made. 
     uint32_t *prev_registers;
     uint32_t index;
+    // Predecoded form of the executable's instructions, indexed the same way.
+    struct decoded_inst *code;
+    // Guest memory of this run, from MEMORY_START. It starts as a copy of the
+    // executable's initial data, which is never written. Allocated memory is
+    // followed by MEMORY_PADDING zeros since address_check lets half and 
+    // word accesses start just past the end of the data.
+    uint8_t *memory;
+    // The mapping 'memory' is in, NULL if it was allocated. With 
+    // IMPS_GUARD_MEMORY it spans the whole guest address space and only its 
+    // first GUARD_DATA_SIZE bytes are accessible, ending where the data does.
+    uint8_t *memory_mapping;
+    size_t memory_mapping_size;
+    // Set by --sparse-memory: every address can be accessed, and memory 
+    // outside the data segment reads as zero until it is written.
+    bool sparse;
+    // The heap runs from HEAP_START up to 'heap_break', which sbrk moves. 
+    // With IMPS_MMAP its pages come from an arena at 'heap' that is reserved
+    // up front and committed HEAP_CHUNK bytes at a time, the first 
+    // 'heap_committed' bytes of which are accessible. With IMPS_GUARD_MEMORY
+    // the arena is the part of the reservation the heap is in, from the host
+    // page HEAP_START is in, and is committed up to the host page the break
+    // is in.
+    uint32_t heap_break;
+    uint8_t *heap;
+    size_t heap_committed;
+    // The stack runs down from STACK_TOP to 'stack_bottom'. With IMPS_MMAP
+    // its pages come from the 'stack_length' bytes at 'stack', a mapping 
+    // made when the stack is first written to that the host only commits a
+    // page at a time, as they are touched. With IMPS_GUARD_MEMORY it is the
+    // part of the reservation the stack is in, widened to GUARD_DATA_SIZE
+    // boundaries.
+    uint32_t stack_bottom;
+    uint8_t *stack;
+    size_t stack_length;
+    // Where compiled code finds the stack: the host address of guest 
+    // 'stack_bottom', and how many bytes from it can be accessed there. The 
+    // length is 0 until every stack page is known to be at its offset from 
+    // there, which with IMPS_MMAP is once the stack mapping has been made, 
+    // unless a fork had already restored stack pages elsewhere.
+    uint8_t *direct_stack;
+    uint32_t direct_stack_length;
+#ifdef IMPS_GUARD_MEMORY
+    // Size of the access in progress shifted up by 32, ORed with its 
+    // address, for the fault handler's message.
+    uint64_t access;
+#else
+    // Number of bytes of 'memory', all of which back guest pages: the data
+    // segment padded to whole pages, then any pages restored by a fork.
+    size_t memory_length;
+    // The guest address space, GUEST_PAGE_SIZE pages found through a two 
+    // level table indexed by the top ten and the next ten bits of an 
+    // address. Pages are only allocated when they are first written.
+    struct page_table *page_tables[PAGE_TABLE_LEN];
+    // Recently used pages for loads and for stores. A page that has never
+    // been written is only entered in 'read_tlb', as the shared zero page.
+    struct tlb_entry read_tlb[TLB_LEN];
+    struct tlb_entry write_tlb[TLB_LEN];
+#endif
+    // Guest input and output, stdin and stdout on the command line.
+    imps_write_fn write;
+    imps_read_fn read;
+    void *io_context;
+    // Runtime errors and the exit syscall stop a run by jumping here with 
+    // the resulting status, errors after filling in 'message'.
+    jmp_buf *escape;
+    char message[IMPS_MESSAGE_LEN];
+    // Block loop state, kept between runs so a run stopped by its budget can
+    // go on where it left off. Every table has an entry for the sentinel.
+    uint32_t num_instructions;
+    struct block **blocks;
+    struct decoded_inst *fused;
+#ifdef IMPS_THREADED
+    void **threaded;
+#endif
+    // Whether compiled blocks may jump straight into each other. Chained 
+    // code only comes back to the block loop when it needs the interpreter,
+    // so runs with a budget need it off.
+    bool chain;
+#ifdef IMPS_JIT
+    // Owned here so that every exit path stops the compile thread before 
+    // the code it reads is freed. Created when the first block is hot 
+    // enough to compile, NULL until then and if that fails.
+    struct jit *jit;
+    bool jit_failed;
+#endif
+};
+
+
+// Guest output of a command line run, collected here and written to stdout
+// a buffer at a time. It is written out when full, before the program reads
+// input and when the run ends.
+struct output_buffer {
+    size_t length;
+    char bytes[OUTPUT_BUFFER_LEN];
+};
+
+// Execution counts gathered by --profile.
+struct profile {
+    char *program_path;
+    char *header_path;
+    uint32_t num_instructions;
+    struct decoded_inst *code;
+    // Number of times each instruction was executed.
+    uint64_t *counts;
+};
+
+// A straight line sequence of instruction handlers and how many times it was
+// executed. The handlers are packed into the key PROFILE_HANDLER_BITS at a 
+// time, first handler lowest.
+struct sequence {
+    uint32_t key;
+    uint32_t length;
+    uint64_t count;
 };
 
 // File struct to emulate an in memory file system
@@ -133,38 +572,852 @@ struct descriptor {
     bool write;
 };
 
+#ifndef IMPS_LIBRARY
+// The profile being gathered by --profile, written out when the program 
+// exits. NULL when not profiling.
+static struct profile *active_profile = NULL;
+#endif
+
+// Patterns of the generated superinstructions, in the order they are tried,
+// ending with an empty pattern.
+static const struct fused_pattern fused_patterns[] = {
+#define FUSED_PATTERN(name, length, a, b, c, d) \
+    {HANDLER_##name, length, \
+     {HANDLER_##a, HANDLER_##b, HANDLER_##c, HANDLER_##d}},
+    GENERATED_SUPERINSTRUCTIONS(FUSED_PATTERN)
+#undef FUSED_PATTERN
+    {HANDLER_NONE, 0, {HANDLER_NONE}}
+};
+
+// Execution thresholds chosen on the command line.
+struct run_options {
+    uint32_t threaded_after;
+    uint32_t jit_after;
+    // Every guest address can be accessed, not only the data segment.
+    bool sparse_memory;
+    // Largest size of the stack in bytes.
+    uint32_t stack_size;
+};
+
+// A program loaded by the library, shared read only by the instance that 
+// loaded it, its snapshots and every instance forked from them.
+struct imps_program {
+    atomic_uint references;
+    // Private copy of the loaded executable, which 'executable' points into.
+    uint8_t *image;
+    struct imps_file executable;
+    struct decoded_inst *code;
+};
+
+// An emulator instance of the library interface in imps.h.
+struct imps_vm {
+    struct imps_program *program;
+    struct runtime_data *data;
+    struct file *files;
+    struct descriptor *descriptors;
+    struct run_options options;
+    imps_write_fn write;
+    imps_read_fn read;
+    void *io_context;
+    int status;
+    char message[IMPS_MESSAGE_LEN];
+};
+
+// The state of an instance between two runs, see imps_vm_snapshot.
+struct imps_snapshot {
+    struct imps_program *program;
+    uint32_t registers[NUM_REGISTERS];
+    uint32_t index;
+    struct file files[MAX_FILE_NUM];
+    struct descriptor descriptors[MAX_DESC_NUM];
+    // Memory of the instance, as saved by save_memory: the bytes backing the
+    // data segment followed by each page at the guest addresses in 'pages',
+    // or with IMPS_GUARD_MEMORY by the committed part of the heap arena and
+    // the stack.
+    // With IMPS_MMAP it is kept in an unlinked temporary file that forks map
+    // privately, so they share its pages until they write to them.
+#ifdef IMPS_MMAP
+    FILE *memory_file;
+#else
+    uint8_t *memory;
+#endif
+    size_t memory_length;
+    uint32_t *pages;
+    uint32_t num_pages;
+    uint32_t heap_break;
+    struct run_options options;
+    imps_write_fn write;
+    imps_read_fn read;
+    void *io_context;
+};
+
+#ifdef IMPS_BATCH
+// An executable named in a batch manifest. It is loaded and predecoded once,
+// then shared read only by every job that runs it.
+struct batch_program {
+    char *path;
+    struct imps_file executable;
+    struct loaded_image image;
+    // The file as read, which 'executable' points into, or NULL if it was 
+    // mapped from the translation cache.
+    char *bytes;
+    // Whether it loaded; if not, 'message' is what a single run would have
+    // printed, and every job running it fails with that.
+    bool loaded;
+    char message[IMPS_MESSAGE_LEN];
+};
+
+// Bytes a job has printed, kept until the jobs before it have been written.
+struct batch_output {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+};
+
+// One line of a batch manifest: an executable and the file its input is read
+// from, if any.
+struct batch_job {
+    char *path;
+    char *input_path;
+    struct batch_program *program;
+    char *input;
+    size_t input_length;
+    size_t input_position;
+    struct batch_output output;
+    // The job's run while it is running, stopped if its output can't be 
+    // kept.
+    struct runtime_data *data;
+    int status;
+    char message[IMPS_MESSAGE_LEN];
+    // Set under the batch lock once the job has finished.
+    bool done;
+};
+
+// The jobs a worker has not started yet, [head, tail) of the batch's jobs.
+// The worker takes them from the head while idle workers steal from the
+// tail.
+struct batch_queue {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+};
+
+// Everything shared by the workers of a batch run.
+struct batch {
+    struct batch_job *jobs;
+    uint32_t num_jobs;
+    struct batch_program *programs;
+    uint32_t num_programs;
+    struct batch_queue *queues;
+    uint32_t num_workers;
+    struct run_options *options;
+    // Protects the 'done' flags of the jobs, signalled as each finishes.
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+// Argument of a worker thread.
+struct batch_worker {
+    struct batch *batch;
+    uint32_t id;
+};
+#endif
+
+// A basic block of predecoded instructions, created the first time its first
+// instruction is executed.
+struct block {
+    uint32_t start;
+    uint32_t length;
+    // Tier the block runs in and the number of times it has been entered, 
+    // counted until it is sent to the JIT.
+    uint8_t tier;
+    uint32_t executions;
+    // Compiled code of the block once it is in TIER_NATIVE.
+    uint8_t *native;
+    // Blocks executed next when falling through and when a branch is taken,
+    // filled in the first time each exit is taken.
+    struct block *next[BLOCK_EXITS];
+};
+
+#ifdef IMPS_JIT
+// A compiled block is called with the register file, guest memory and the 
+// direct stack of runtime_data and returns the index of the next 
+// instruction. JIT_INTERPRET is set in the result if that instruction must be
+// run by the interpreter, and the bits from JIT_EXIT_SHIFT up hold the offset
+// of the exit taken in the code buffer if it can be chained.
+typedef uint64_t (*jit_block)(uint32_t *registers, uint8_t *memory, 
+                              uint8_t *stack, uint32_t stack_length);
+
+// Starts of blocks waiting to be compiled. The block loop is the only 
+// producer and the compile thread the only consumer, so the ring needs no
+// lock: each side only writes its own end.
+struct jit_queue {
+    uint32_t starts[JIT_QUEUE_SIZE];
+    // Next entry to pop, only written by the compile thread.
+    atomic_uint head;
+    // Next entry to push, only written by the block loop.
+    atomic_uint tail;
+};
+
+// Code buffer and block table of the JIT. Only the compile thread writes 
+// new code; the block loop only patches exits of blocks it has been given.
+struct jit {
+    // The code buffer, written at 'buffer' and run at 'exec'.
+    uint8_t *buffer;
+    uint8_t *exec;
+    size_t used;
+    // Program being compiled.
+    struct decoded_inst *code;
+    struct imps_file *executable;
+    // Lowest guest stack address, where the direct stack starts.
+    uint32_t stack_bottom;
+    // Compiled block starting at each instruction, NULL if there is none.
+    _Atomic(uint8_t *) *blocks;
+    // Whether compiling a block at each instruction has been tried. Set 
+    // after the block itself, so a block is complete once this is seen.
+    atomic_bool *attempted;
+#ifdef IMPS_JIT_THREAD
+    // Whether the compile thread is running. If it could not be started, 
+    // blocks are compiled on the spot.
+    bool threaded;
+    pthread_t thread;
+    struct jit_queue queue;
+    // Posted once per request pushed and to stop the thread.
+    sem_t pending;
+    // Whether 'pending' was initialised, which it can be without the thread.
+    bool pending_ready;
+    atomic_bool stopping;
+#endif
+};
+
+// Location of a jump to an error exit that still needs its offset filled in.
+struct jit_fixup {
+    size_t patch;
+    uint32_t index;
+};
+#endif
+
+#ifndef IMPS_LIBRARY
+// Helpers included in every program generated by --emit-c. They mirror the
+// emulator's own syscalls and checks, including their error messages.
+static const char emit_c_runtime[] =
+    "#include <inttypes.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#define MEMORY_START 0x10010000\n"
+    "#define HEAP_START 0x10040000\n"
+    "#define HEAP_MAX_SIZE 0x40000000\n"
+    "#define STACK_TOP 0x80000000u\n"
+    "#define STACK_BOTTOM (STACK_TOP - STACK_SIZE)\n"
+    "#define MAX_FILE_SIZE 128\n"
+    "#define MAX_FILE_NUM 6\n"
+    "#define MAX_DESC_NUM 8\n"
+    "#define MAX_PATH_LEN 65535\n"
+    "\n"
+    "static uint8_t memory[MEMORY_SIZE + 4];\n"
+    "static uint8_t *heap;\n"
+    "static uint32_t heap_break = HEAP_START;\n"
+    "static size_t heap_capacity;\n"
+    "static uint8_t stack[STACK_SIZE + 4];\n"
+    "\n"
+    "struct file {\n"
+    "    char *path;\n"
+    "    char data[MAX_FILE_SIZE];\n"
+    "    int size;\n"
+    "};\n"
+    "\n"
+    "struct descriptor {\n"
+    "    int file_index;\n"
+    "    int pos;\n"
+    "    bool read;\n"
+    "    bool write;\n"
+    "};\n"
+    "\n"
+    "static struct file files[MAX_FILE_NUM];\n"
+    "static struct descriptor descriptors[MAX_DESC_NUM];\n"
+    "\n"
+    "static inline void imps_init(void) {\n"
+    "    for (int i = 0; i < MAX_DESC_NUM; i++) {\n"
+    "        descriptors[i].file_index = -1;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void imps_error(const char *message) {\n"
+    "    fprintf(stderr, \"IMPS error: %s\\n\", message);\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "\n"
+    "static inline void bad_instruction(uint32_t instruction) {\n"
+    "    fprintf(stderr, \"IMPS error: bad instruction 0x%08\" PRIx32 \"\\n\", \n"
+    "            instruction);\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "\n"
+    "static inline void overflow_check(int value1, int value2) {\n"
+    "    if ((value1 > 0 && value2 > INT32_MAX - value1) || \n"
+    "        (value1 < 0 && value2 < INT32_MIN - value1)) {\n"
+    "        imps_error(\"addition would overflow\");\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t count_leading_zeros(uint32_t value) {\n"
+    "    uint32_t count = 0;\n"
+    "    for (int i = 31; i >= 0 && ((value >> i) & 1) == 0; i--) {\n"
+    "        count++;\n"
+    "    }\n"
+    "    return count;\n"
+    "}\n"
+    "\n"
+    "static inline uint8_t *address_check(uint32_t address, int num_bytes) {\n"
+    "    if (((address < MEMORY_START || \n"
+    "          address >= MEMORY_START + MEMORY_SIZE + (num_bytes - 1)) &&\n"
+    "         (address < HEAP_START || address >= heap_break) &&\n"
+    "         (address < STACK_BOTTOM || address >= STACK_TOP)) ||\n"
+    "        address % num_bytes != 0) {\n"
+    "        fprintf(stderr, \"IMPS error: bad address for %s access: 0x%08\" \n"
+    "                PRIx32 \"\\n\", num_bytes == 1 ? \"byte\" : \n"
+    "                num_bytes == 2 ? \"half\" : \"word\", address);\n"
+    "        exit(EXIT_FAILURE);\n"
+    "    }\n"
+    "    if (address >= STACK_BOTTOM) {\n"
+    "        return stack + (address - STACK_BOTTOM);\n"
+    "    } else if (address >= HEAP_START) {\n"
+    "        return heap + (address - HEAP_START);\n"
+    "    }\n"
+    "    return memory + (address - MEMORY_START);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t load_byte(uint8_t *p) {\n"
+    "    return (uint32_t)(int8_t)p[0];\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t load_half(uint8_t *p) {\n"
+    "    return (uint32_t)(int16_t)(p[0] | p[1] << 8);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t load_word(uint8_t *p) {\n"
+    "    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |\n"
+    "           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;\n"
+    "}\n"
+    "\n"
+    "static inline void store_byte(uint8_t *p, uint32_t value) {\n"
+    "    p[0] = value;\n"
+    "}\n"
+    "\n"
+    "static inline void store_half(uint8_t *p, uint32_t value) {\n"
+    "    p[0] = value;\n"
+    "    p[1] = value >> 8;\n"
+    "}\n"
+    "\n"
+    "static inline void store_word(uint8_t *p, uint32_t value) {\n"
+    "    p[0] = value;\n"
+    "    p[1] = value >> 8;\n"
+    "    p[2] = value >> 16;\n"
+    "    p[3] = value >> 24;\n"
+    "}\n"
+    "\n"
+    "static inline void sbrk(uint32_t *r) {\n"
+    "    int32_t amount = r[4];\n"
+    "    uint64_t end = heap_break + (((uint64_t)amount + 3) & ~(uint64_t)3);\n"
+    "    if (amount < 0 || end > (uint64_t)HEAP_START + HEAP_MAX_SIZE) {\n"
+    "        fprintf(stderr, \"IMPS error: bad sbrk amount: %\" PRIi32 \"\\n\", \n"
+    "                amount);\n"
+    "        exit(EXIT_FAILURE);\n"
+    "    }\n"
+    "    size_t needed = end - HEAP_START + 1;\n"
+    "    if (needed > heap_capacity) {\n"
+    "        size_t capacity = heap_capacity == 0 ? 4096 : heap_capacity;\n"
+    "        while (capacity < needed) {\n"
+    "            capacity *= 2;\n"
+    "        }\n"
+    "        heap = realloc(heap, capacity);\n"
+    "        if (heap == NULL) {\n"
+    "            imps_error(\"no memory for the heap\");\n"
+    "        }\n"
+    "        memset(heap + heap_capacity, 0, capacity - heap_capacity);\n"
+    "        heap_capacity = capacity;\n"
+    "    }\n"
+    "    r[2] = heap_break;\n"
+    "    heap_break = end;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t lowest_desc(int i, uint32_t type) {\n"
+    "    int j = 0;\n"
+    "    while (descriptors[j].file_index != -1 && j < MAX_DESC_NUM) {\n"
+    "        j++;\n"
+    "    }\n"
+    "    descriptors[j].file_index = i;\n"
+    "    if (type == 0) {\n"
+    "        descriptors[j].read = true;\n"
+    "    } else {\n"
+    "        descriptors[j].write = true;\n"
+    "    }\n"
+    "    return j;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t bytes_left(uint32_t address) {\n"
+    "    if (address >= STACK_BOTTOM) {\n"
+    "        return STACK_TOP - address;\n"
+    "    } else if (address >= HEAP_START) {\n"
+    "        return heap_break - address;\n"
+    "    }\n"
+    "    return MEMORY_START + MEMORY_SIZE - address;\n"
+    "}\n"
+    "\n"
+    "static inline void print_string(uint32_t address) {\n"
+    "    uint8_t *p = address_check(address, 1);\n"
+    "    uint32_t limit = bytes_left(address);\n"
+    "    uint8_t *end = memchr(p, '\\0', limit);\n"
+    "    fwrite(p, 1, end == NULL ? limit : (uint32_t)(end - p), stdout);\n"
+    "    if (end == NULL && p[limit] != '\\0') {\n"
+    "        address_check(address + limit, 1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void open_file(uint32_t *r) {\n"
+    "    uint8_t *p = address_check(r[4], 1);\n"
+    "    uint32_t limit = bytes_left(r[4]);\n"
+    "    if (limit > MAX_PATH_LEN) {\n"
+    "        limit = MAX_PATH_LEN;\n"
+    "    }\n"
+    "    char path_name[MAX_PATH_LEN + 1];\n"
+    "    uint32_t length = 0;\n"
+    "    while (length < limit && p[length] != '\\0') {\n"
+    "        path_name[length] = p[length];\n"
+    "        length++;\n"
+    "    }\n"
+    "    path_name[length] = '\\0';\n"
+    "    bool exists = false;\n"
+    "    for (int i = 0; i < MAX_FILE_NUM; i++) {\n"
+    "        if (files[i].path != NULL && strcmp(files[i].path, path_name) == 0) {\n"
+    "            exists = true;\n"
+    "            r[2] = lowest_desc(i, r[5]);\n"
+    "        }\n"
+    "    }\n"
+    "    if (!exists && r[5] == 0) {\n"
+    "        r[2] = -1;\n"
+    "    }\n"
+    "    if (!exists && r[5] == 1) {\n"
+    "        int i = 0;\n"
+    "        while (files[i].path != NULL && i < MAX_FILE_NUM) {\n"
+    "            i++;\n"
+    "        }\n"
+    "        files[i].path = strdup(path_name);\n"
+    "        r[2] = lowest_desc(i, r[5]);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void read_file(uint32_t *r) {\n"
+    "    struct descriptor *desc = &descriptors[r[4]];\n"
+    "    if (desc->read == false) {\n"
+    "        r[2] = -1;\n"
+    "        return;\n"
+    "    }\n"
+    "    int num_bytes = r[6];\n"
+    "    int file_size = files[desc->file_index].size;\n"
+    "    int read_size = num_bytes;\n"
+    "    if (desc->pos + num_bytes > file_size) {\n"
+    "        read_size = file_size - desc->pos;\n"
+    "    }\n"
+    "    for (int i = 0; i < read_size; i++) {\n"
+    "        *address_check(r[5] + i, 1) = \n"
+    "            files[desc->file_index].data[desc->pos + i];\n"
+    "    }\n"
+    "    r[2] = read_size;\n"
+    "    desc->pos += read_size;\n"
+    "}\n"
+    "\n"
+    "static inline void write_file(uint32_t *r) {\n"
+    "    struct descriptor *desc = &descriptors[r[4]];\n"
+    "    if (desc->write == false) {\n"
+    "        r[2] = -1;\n"
+    "        return;\n"
+    "    }\n"
+    "    int num_bytes = r[6];\n"
+    "    int write_size = num_bytes;\n"
+    "    if (desc->pos + num_bytes > MAX_FILE_SIZE) {\n"
+    "        write_size = MAX_FILE_SIZE - desc->pos;\n"
+    "    }\n"
+    "    struct file *file = &files[desc->file_index];\n"
+    "    for (int i = 0; i < write_size; i++) {\n"
+    "        file->data[desc->pos + i] = *address_check(r[5] + i, 1);\n"
+    "    }\n"
+    "    if (desc->pos + write_size > file->size) {\n"
+    "        file->size = desc->pos + write_size;\n"
+    "    }\n"
+    "    desc->pos += write_size;\n"
+    "    r[2] = write_size;\n"
+    "}\n"
+    "\n"
+    "static inline void close_file(uint32_t *r) {\n"
+    "    if (r[4] >= MAX_DESC_NUM || descriptors[r[4]].file_index == -1) {\n"
+    "        r[2] = -1;\n"
+    "    } else {\n"
+    "        descriptors[r[4]].file_index = -1;\n"
+    "        descriptors[r[4]].pos = 0;\n"
+    "        descriptors[r[4]].read = false;\n"
+    "        descriptors[r[4]].write = false;\n"
+    "        r[2] = 0;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void imps_syscall(uint32_t *r) {\n"
+    "    if (r[2] == 1) {\n"
+    "        printf(\"%\" PRIi32, (int32_t)r[4]);\n"
+    "    } else if (r[2] == 4) {\n"
+    "        print_string(r[4]);\n"
+    "    } else if (r[2] == 9) {\n"
+    "        sbrk(r);\n"
+    "    } else if (r[2] == 10) {\n"
+    "        exit(EXIT_SUCCESS);\n"
+    "    } else if (r[2] == 11) {\n"
+    "        putchar(r[4]);\n"
+    "    } else if (r[2] == 12) {\n"
+    "        int ch = getchar();\n"
+    "        r[2] = ch == EOF ? (uint32_t)-1 : (uint32_t)ch;\n"
+    "    } else if (r[2] == 13) {\n"
+    "        open_file(r);\n"
+    "    } else if (r[2] == 14) {\n"
+    "        read_file(r);\n"
+    "    } else if (r[2] == 15) {\n"
+    "        write_file(r);\n"
+    "    } else if (r[2] == 16) {\n"
+    "        close_file(r);\n"
+    "    } else {\n"
+    "        imps_error(\"bad syscall number\");\n"
+    "    }\n"
+    "}\n";
+#endif
+
 // Function prototypes used during implementation
+#ifndef IMPS_LIBRARY
 void read_imps_file(char *path, struct imps_file *executable);
 
 void execute_imps(struct imps_file *executable, int trace_mode, char *path);
+#endif
 
 void print_uint32_in_hexadecimal(FILE *stream, uint32_t value);
 
 void print_int32_in_decimal(FILE *stream, int32_t value);
 
+#ifndef IMPS_LIBRARY
+static void read_executable(char *path, struct imps_file *executable, 
+                            bool debug);
+
 static void check_magic_number(FILE *input_stream);
 
 static uint32_t get_lit_end_int(FILE *input_stream, int num_bytes);
 
+static int64_t remaining_bytes(FILE *input_stream);
+
+static void check_section(FILE *input_stream, int64_t remaining, 
+                          uint64_t needed, const char *section);
+
+static void invalid_imps_file(FILE *input_stream, const char *format, ...);
+#endif
+
 static void initialise_files(struct file *files, 
                              struct descriptor *descriptors);
 
-static void print_past_end(struct runtime_data *data, struct file *files, 
-                           struct descriptor *descriptors);
+static void print_past_end(struct runtime_data *data);
+
+static struct runtime_data *create_data(struct decoded_inst *code,
+                                        struct imps_file *executable,
+                                        struct run_options *options);
+
+static bool create_memory(struct runtime_data *data, 
+                          struct imps_file *executable);
+
+static void free_memory(struct runtime_data *data);
+
+static uint8_t *memory_contents(struct runtime_data *data, 
+                                struct imps_file *executable, size_t *length);
+
+static bool save_memory(struct runtime_data *data, 
+                        struct imps_file *executable, 
+                        struct imps_snapshot *snapshot);
+
+static bool restore_memory(struct runtime_data *data, 
+                           struct imps_file *executable,
+                           struct imps_snapshot *snapshot);
+
+#ifndef IMPS_GUARD_MEMORY
+static size_t data_pages_length(struct imps_file *executable);
+
+static void grow_heap(struct runtime_data *data, uint32_t end);
+
+static bool map_memory(struct runtime_data *data, size_t data_length, 
+                       uint32_t *pages, uint32_t num_pages);
+
+static bool map_page(struct runtime_data *data, uint32_t address, 
+                     uint8_t *page);
+
+static uint8_t **page_entry(struct runtime_data *data, uint32_t address, 
+                            bool create);
+
+static uint8_t *find_page(struct runtime_data *data, uint32_t address, 
+                          bool write);
+
+static uint8_t *stack_page(struct runtime_data *data, uint32_t address);
+
+static uint32_t list_pages(struct runtime_data *data, uint32_t start, 
+                           uint32_t end, uint32_t *pages);
+
+#ifdef IMPS_MMAP
+static bool stack_pages_entered(struct runtime_data *data);
+#endif
+
+static bool enter_direct_stack_pages(struct runtime_data *data);
+
+static uint8_t *tlb_miss(struct runtime_data *data, uint32_t address, 
+                         struct imps_file *executable, int num_bytes, 
+                         bool store);
+#endif
+
+#ifdef IMPS_GUARD_MEMORY
+static void install_guard_handler(void);
+
+static void install_guard_actions(void);
+
+static void guard_handler(int signal, siginfo_t *info, void *context);
+#endif
+
+_Noreturn static void stop_run(struct runtime_data *data, int status, 
+                               const char *format, ...);
+
+static void stdio_write(void *context, const char *bytes, size_t length);
+
+static int stdio_read(void *context);
+
+#ifndef IMPS_LIBRARY
+static void buffered_write(void *context, const char *bytes, size_t length);
+
+static int buffered_read(void *context);
+
+static void flush_output(struct output_buffer *output);
+
+static void write_stdout(const char *bytes, size_t length);
+#endif
+
+static char *format_int32(char *end, int32_t value);
+
+static void unload_program(struct imps_vm *vm);
+
+static void release_program(struct imps_program *program);
+
+static void copy_files(struct file *to, struct file *from);
+
+static bool parse_executable(uint8_t *bytes, uint64_t size, bool debug,
+                             struct imps_file *executable, char *message,
+                             size_t message_size);
+
+static bool section_fits(uint64_t remaining, uint64_t needed, 
+                         const char *section, char *message, 
+                         size_t message_size);
+
+static uint32_t read_lit_end_int(uint8_t *bytes, int num_bytes);
 
 static void free_data(struct runtime_data *data, struct file *files, 
                      struct descriptor *descriptors);
 
+#ifndef IMPS_LIBRARY
 static void trace(struct runtime_data *data, struct imps_file *executable, 
                   char *path);
 
-static void add_i_inst(uint32_t execute, struct runtime_data *data);
+static void run_switch(struct runtime_data *data, struct imps_file *executable,
+                       struct file *files, struct descriptor *descriptors,
+                       int trace_mode, char *path);
+
+static void run_imps(struct imps_file *executable, struct decoded_inst *code,
+                     int trace_mode, char *path, struct run_options *options);
+
+_Noreturn static void guest_memory_error(void);
+
+static void load_imps_file(char *path, char *cache_dir, bool debug,
+                           struct imps_file *executable, 
+                           struct loaded_image *image);
+
+static void free_imps_file(struct imps_file *executable, 
+                           struct loaded_image *image);
+
+#ifdef IMPS_MMAP
+static bool map_imps_file(char *path, bool debug, 
+                          struct imps_file *executable, 
+                          struct loaded_image *image);
+
+#endif
+#endif
+
+#ifdef IMPS_CACHE
+static char *cache_file_path(char *path, char *cache_dir, uint64_t *key);
+
+static char *cache_key_path(const uint8_t *bytes, size_t size, 
+                            char *cache_dir, uint64_t *key);
+
+static bool map_cache_file(char *cache_path, uint64_t key, 
+                           struct imps_file *executable, 
+                           struct loaded_image *image);
+
+static void write_cache_file(char *cache_path, uint64_t key, 
+                             struct imps_file *executable, 
+                             struct decoded_inst *code);
+
+static bool cached_code_valid(struct decoded_inst *code, 
+                              uint32_t num_instructions, 
+                              uint32_t entry_point, uint32_t memory_size);
+
+static uint64_t cache_file_size(uint32_t num_instructions, 
+                                uint32_t memory_size);
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t length);
+#endif
+
+#ifdef IMPS_BATCH
+static int run_batch(char *manifest_path, uint32_t num_workers, 
+                     char *cache_dir, struct run_options *options);
+
+static void read_manifest(char *manifest_path, struct batch *batch);
+
+static void load_batch_programs(struct batch *batch, char *cache_dir);
+
+_Noreturn static void batch_memory_error(void);
+
+static bool load_batch_program(struct batch_program *program, 
+                               char *cache_dir);
+
+static int compare_job_paths(const void *first, const void *second);
+
+static void *batch_worker(void *arg);
+
+static bool take_batch_job(struct batch *batch, uint32_t id, uint32_t *job);
+
+static void run_batch_job(struct batch_job *job, struct run_options *options);
+
+static void batch_write(void *context, const char *bytes, size_t length);
+
+static int batch_read(void *context);
+
+static char *read_whole_file(char *path, size_t *length);
+#endif
+
+static void run_blocks(struct runtime_data *data, 
+                       struct imps_file *executable, struct file *files,
+                       struct descriptor *descriptors, 
+                       struct run_options *options, uint64_t budget);
+
+static struct block *find_block(struct block **blocks, 
+                                struct decoded_inst *code, uint32_t start);
+
+static struct block *next_block(struct block *block, struct block **blocks,
+                                struct decoded_inst *code, uint32_t index);
+
+static bool ends_block(uint8_t handler);
 
-static void funct_check(uint32_t execute, struct runtime_data *data, 
-                        struct imps_file *executable, struct file *files,
-                        struct descriptor *descriptors);
+static void free_blocks(struct block **blocks, uint32_t num_instructions);
 
-static void overflow_check(int value1, int value2);
+static IMPS_ALWAYS_INLINE void execute_inst(struct decoded_inst *inst, 
+                                             struct runtime_data *data,
+                                             struct imps_file *executable, 
+                                             struct file *files,
+                                             struct descriptor *descriptors);
+
+
+#ifdef IMPS_JIT
+static struct jit *jit_create(struct decoded_inst *code, 
+                              struct imps_file *executable, 
+                              uint32_t stack_bottom);
+
+static bool jit_map_buffer(uint8_t **buffer, uint8_t **exec);
+
+static void jit_unmap_buffer(uint8_t *buffer, uint8_t *exec);
+
+static void jit_destroy(struct jit *jit);
+
+static bool jit_request(struct jit *jit, uint32_t start);
+
+static bool jit_lookup(struct jit *jit, uint32_t start, uint8_t **entry);
+
+static void jit_compile(struct jit *jit, uint32_t start);
+
+#ifdef IMPS_JIT_THREAD
+static void *jit_compile_thread(void *arg);
+
+static bool jit_queue_push(struct jit_queue *queue, uint32_t start);
+
+static bool jit_queue_pop(struct jit_queue *queue, uint32_t *start);
+#endif
+
+static void jit_chain(struct jit *jit, uint32_t stub, uint32_t target);
+
+static uint8_t *jit_compile_block(struct jit *jit, struct decoded_inst *code,
+                                  struct imps_file *executable, 
+                                  uint32_t start);
+
+static bool jit_can_compile(uint8_t handler);
+
+static int jit_emit_arith(struct jit *jit, struct decoded_inst *inst,
+                          uint32_t index, struct jit_fixup *fixups);
+
+static int jit_emit_mem(struct jit *jit, struct decoded_inst *inst,
+                        struct imps_file *executable, uint32_t index,
+                        struct jit_fixup *fixups);
+
+static void jit_emit_access(struct jit *jit, struct decoded_inst *inst,
+                            uint8_t rex, uint8_t sib);
+
+static void jit_emit_branch(struct jit *jit, struct decoded_inst *inst,
+                            uint32_t index);
+
+static int jit_emit_fail_jump(struct jit *jit, uint8_t condition, 
+                              uint32_t index, struct jit_fixup *fixup);
+
+static void jit_emit_exit(struct jit *jit, uint64_t result);
+
+static void jit_emit_chain_exit(struct jit *jit, uint32_t target);
+
+static void jit_emit_epilogue(struct jit *jit);
+
+static void jit_load_reg(struct jit *jit, uint8_t host, uint8_t guest);
+
+static void jit_store_reg(struct jit *jit, uint8_t host, uint8_t guest);
+
+static void jit_emit_bytes(struct jit *jit, int count, ...);
+
+static void jit_emit_byte(struct jit *jit, uint8_t byte);
+
+static void jit_emit_u32(struct jit *jit, uint32_t value);
+#endif
+
+static void add_i_inst(struct decoded_inst *inst, struct runtime_data *data);
+
+static struct decoded_inst *predecode(struct imps_file *executable);
+
+static void verify_code(struct decoded_inst *code, uint32_t num_instructions);
+
+static void fuse_superinstructions(struct decoded_inst *code, 
+                                   struct decoded_inst *fused,
+                                   uint32_t num_instructions, uint32_t start,
+                                   uint32_t end);
+
+static uint8_t generated_handler(struct decoded_inst *code, 
+                                 uint32_t num_instructions, uint32_t index);
+
+static uint8_t fused_handler(uint8_t first, uint8_t second);
+
+static IMPS_ALWAYS_INLINE uint32_t inst_length(uint8_t handler);
+
+static void decode_inst(uint32_t execute, struct decoded_inst *inst);
+
+static void decode_funct(uint32_t execute, struct decoded_inst *inst);
+
+static void decode_mem(uint32_t execute, struct decoded_inst *inst);
+
+static uint32_t sign_extend(uint32_t immediate);
+
+static void overflow_check(struct runtime_data *data, int value1, int value2);
 
 static void syscall(struct runtime_data *data, struct imps_file *executable, 
                     struct file *files, struct descriptor *descriptors);
@@ -172,11 +1425,37 @@ static void syscall(struct runtime_data *data, struct imps_file *executable,
 static void print_string(struct runtime_data *data, 
                         struct imps_file *exectuable);
 
-static void address_check(uint32_t address, struct imps_file *executable, 
-                          int num_bytes);
+static uint8_t *string_run(struct runtime_data *data, uint32_t address,
+                           struct imps_file *executable, size_t *length);
+
+static void address_check(struct runtime_data *data, uint32_t address, 
+                          struct imps_file *executable, int num_bytes);
+
+_Noreturn static void bad_address(struct runtime_data *data, uint32_t address,
+                                  int num_bytes);
+
+static IMPS_ALWAYS_INLINE uint8_t *guest_memory(struct runtime_data *data, 
+                                                uint32_t address, 
+                                                struct imps_file *executable,
+                                                int num_bytes, bool store);
+
+static uint8_t peek_byte(struct runtime_data *data, uint32_t address, 
+                         struct imps_file *executable);
+
+static IMPS_ALWAYS_INLINE void discard_load(uint8_t *bytes, int num_bytes);
+
+static IMPS_ALWAYS_INLINE uint32_t load_half(uint8_t *bytes);
+
+static IMPS_ALWAYS_INLINE uint32_t load_word(uint8_t *bytes);
+
+static IMPS_ALWAYS_INLINE void store_half(uint8_t *bytes, uint32_t value);
+
+static IMPS_ALWAYS_INLINE void store_word(uint8_t *bytes, uint32_t value);
 
 static void read_char(struct runtime_data *data);
 
+static void extend_heap(struct runtime_data *data);
+
 static void open_file(struct runtime_data *data, struct file *files,
                       struct descriptor *descriptors, 
                       struct imps_file *executable);
@@ -196,215 +1475,4147 @@ static void close_file(struct runtime_data *data, struct file *files,
                        struct descriptor *descriptors, 
                        struct imps_file *executable);
 
-static void add_inst(uint32_t execute, struct runtime_data *data);
-
-static void clo_inst(uint32_t execute, struct runtime_data *data);
+static void add_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void clz_inst(uint32_t execute, struct runtime_data *data);
+static void clo_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void addu_inst(uint32_t execute, struct runtime_data *data);
+static void clz_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void slt_inst(uint32_t execute, struct runtime_data *data);
+static void addu_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void print_bad_instruction(uint32_t execute, struct runtime_data *data,
-                                  struct file *files,
-                                  struct descriptor *descriptors);
+static void slt_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void ori_inst(uint32_t execute, struct runtime_data *data);
+static void print_bad_instruction(uint32_t execute, 
+                                  struct runtime_data *data);
 
-static void lui_inst(uint32_t execute, struct runtime_data *data);
+static void ori_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void addiu_inst(uint32_t execute, struct runtime_data *data);
+static void lui_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void mul_inst(uint32_t execute, struct runtime_data *data);
+static void addiu_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void beq_inst(uint32_t execute, struct runtime_data *data);
+static void mul_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void bne_inst(uint32_t execute, struct runtime_data *data);
+static void beq_inst(struct decoded_inst *inst, struct runtime_data *data);
 
+static void bne_inst(struct decoded_inst *inst, struct runtime_data *data);
 
-static void mem_inst(uint32_t execute, struct runtime_data *data,
-                     struct imps_file *executable, struct file *files,
-                     struct descriptor *descriptors);
 
-static void lb_inst(uint32_t execute, struct runtime_data *data, 
+static void lb_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
-static void lh_inst(uint32_t execute, struct runtime_data *data,
+static void lh_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
-static void lw_inst(uint32_t execute, struct runtime_data *data,
+static void lw_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
-static void sb_inst(uint32_t execute, struct runtime_data *data,
+static void sb_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
-static void sh_inst(uint32_t execute, struct runtime_data *data,
+static void sh_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
-static void sw_inst(uint32_t execute, struct runtime_data *data,
+static void sw_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable);
 
+#ifndef IMPS_LIBRARY
 static void print_modified(struct runtime_data *data);
+#endif
+
+static void lui_ori_inst(struct decoded_inst *inst, struct runtime_data *data);
+
+static void slt_beq_inst(struct decoded_inst *inst, struct runtime_data *data);
+
+static void slt_bne_inst(struct decoded_inst *inst, struct runtime_data *data);
+
+static void addi_bne_inst(struct decoded_inst *inst, 
+                          struct runtime_data *data);
+
+#define FUSED_PROTOTYPE(name, length, a, b, c, d) \
+    static void fused_##name##_inst(struct decoded_inst *inst, \
+                                    struct runtime_data *data, \
+                                    struct imps_file *executable);
+GENERATED_SUPERINSTRUCTIONS(FUSED_PROTOTYPE)
+#undef FUSED_PROTOTYPE
+
+#ifndef IMPS_LIBRARY
+static bool parse_uint32_arg(char *arg, uint32_t *value);
+
+static void emit_c(struct imps_file *executable, char *path, 
+                   struct run_options *options, FILE *stream);
+
+static void emit_c_inst(struct decoded_inst *inst, uint32_t index,
+                        uint32_t num_instructions, FILE *stream);
+
+static int emit_c_access_size(uint8_t handler);
+
+static const char *emit_c_access_name(uint8_t handler);
+
+static void start_profile(struct imps_file *executable, char *path,
+                          char *header_path);
+
+static void finish_profile(void);
+
+static struct sequence *collect_sequences(struct profile *profile,
+                                          uint32_t *num_sequences);
+
+static int compare_sequence_keys(const void *first, const void *second);
+
+static int compare_sequence_savings(const void *first, const void *second);
+
+static void print_sequence(FILE *stream, struct sequence *sequence, 
+                           const char *separator, bool upper_case);
+
+static void write_superinstructions(struct profile *profile, 
+                                    struct sequence *sequences, 
+                                    uint32_t num_sequences);
 
 /**
  * Main function to execute an IMPS emulator.
  */
 int main(int argc, char *argv[]) {
 
-    // Do NOT CHANGE this function
     // put your code in read_imps_file, execute_imps and your own functions
 
-    char *pathname;
+    char *pathname = NULL;
+    char *profile_path = NULL;
+    char *cache_dir = NULL;
+    char *batch_path = NULL;
+#ifdef IMPS_BATCH
+    uint32_t num_workers = 1;
+#endif
     int trace_mode = 0;
-
-    if (argc == 2) {
-        pathname = argv[1];
-    } else if (argc == 3 && strcmp(argv[1], "-t") == 0) {
-        trace_mode = 1;
-        pathname = argv[2];
-    } else {
-        fprintf(stderr, "Usage: imps [-t] <executable>\n");
+    int emit_c_mode = 0;
+    struct run_options options = {TIER_THREADED_AFTER, TIER_JIT_AFTER, false,
+                                  STACK_DEFAULT_SIZE};
+
+    // Options come first, the executable is always the last argument. A 
+    // batch has no executable, its manifest names them.
+    int arg = 1;
+    bool valid = true;
+    while (valid && arg < argc) {
+        if (arg == argc - 1 && batch_path == NULL) {
+            pathname = argv[arg];
+        } else if (strcmp(argv[arg], "-t") == 0) {
+            trace_mode = 1;
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            emit_c_mode = 1;
+        } else if (strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc) {
+            arg++;
+            profile_path = argv[arg];
+        } else if (strcmp(argv[arg], "--threaded-after") == 0 && 
+                   arg + 1 < argc) {
+            arg++;
+            valid = parse_uint32_arg(argv[arg], &options.threaded_after);
+        } else if (strcmp(argv[arg], "--jit-after") == 0 && arg + 1 < argc) {
+            arg++;
+            valid = parse_uint32_arg(argv[arg], &options.jit_after);
+        } else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+            arg++;
+            cache_dir = argv[arg];
+        } else if (strcmp(argv[arg], "--sparse-memory") == 0) {
+            options.sparse_memory = true;
+        } else if (strcmp(argv[arg], "--stack-size") == 0 && arg + 1 < argc) {
+            arg++;
+            valid = parse_uint32_arg(argv[arg], &options.stack_size) && 
+                    options.stack_size >= STACK_MIN_SIZE && 
+                    options.stack_size <= STACK_MAX_SIZE;
+#ifdef IMPS_BATCH
+        } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+            arg++;
+            batch_path = argv[arg];
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            arg++;
+            valid = parse_uint32_arg(argv[arg], &num_workers) && 
+                    num_workers >= 1 && num_workers <= BATCH_MAX_WORKERS;
+#endif
+        } else {
+            valid = false;
+        }
+        arg++;
+    }
+    if (!valid || (pathname == NULL) == (batch_path == NULL) || 
+        trace_mode + emit_c_mode + (profile_path != NULL) + 
+        (batch_path != NULL) > 1) {
+        fprintf(stderr, 
+                "Usage: imps [-t | --emit-c | --profile <header>] "
+                "[--threaded-after <n>] [--jit-after <n>] "
+                "[--cache <dir>] [--sparse-memory] [--stack-size <bytes>] "
+                "<executable>\n");
+#ifdef IMPS_BATCH
+        fprintf(stderr, 
+                "       imps --batch <manifest> [-j <n>] "
+                "[--threaded-after <n>] [--jit-after <n>] "
+                "[--cache <dir>] [--sparse-memory] "
+                "[--stack-size <bytes>]\n");
+#endif
         exit(EXIT_FAILURE);
     }
+#ifdef IMPS_BATCH
+    if (batch_path != NULL) {
+        return run_batch(batch_path, num_workers, cache_dir, &options);
+    }
+#endif
 
     struct imps_file executable = {0};
-    read_imps_file(pathname, &executable);
-
-    execute_imps(&executable, trace_mode, pathname);
+    struct loaded_image image = {0};
+    load_imps_file(pathname, cache_dir, trace_mode == 1, &executable, &image);
+
+    if (emit_c_mode == 1) {
+        emit_c(&executable, pathname, &options, stdout);
+    } else if (profile_path != NULL) {
+        start_profile(&executable, pathname, profile_path);
+        execute_imps(&executable, PROFILE_MODE, pathname);
+    } else {
+        run_imps(&executable, image.code, trace_mode, pathname, &options);
+    }
 
-    free(executable.debug_offsets);
-    free(executable.instructions);
-    free(executable.initial_data);
+    free_imps_file(&executable, &image);
 
     return 0;
 }
 
 /**
- * Reads an IMPS exectuable file from the file at 'path' into 'executable'.
- * Exists the program if the file can't be accessed or is not well-formed.
+ * Reads a number given on the command line into 'value'. Returns false if 
+ * 'arg' is not a decimal number that fits in 32 bits.
  */
-void read_imps_file(char *path, struct imps_file *executable) {
-    FILE *input_stream = fopen(path, "r");
-    if (input_stream == NULL) {
-        perror(path);
-        exit(EXIT_FAILURE);
+static bool parse_uint32_arg(char *arg, uint32_t *value) {
+    char *end;
+    unsigned long number = strtoul(arg, &end, 10);
+    if (!isdigit((unsigned char)arg[0]) || *end != '\0' || 
+        number > UINT32_MAX) {
+        return false;
     }
-    check_magic_number(input_stream);
+    *value = number;
+    return true;
+}
 
-    // Number of instructions
-    uint32_t num_instructions = get_lit_end_int(input_stream, INSTRUCTIONS_LEN);
-    executable->num_instructions = num_instructions;
+/**
+ * Translates the whole executable into a single C program with the same 
+ * observable behaviour and writes it to 'stream'. Every branch becomes a 
+ * direct goto and memory accesses and syscalls become calls to the helpers
+ * in emit_c_runtime.
+ */
+static void emit_c(struct imps_file *executable, char *path, 
+                   struct run_options *options, FILE *stream) {
+    struct decoded_inst *code = predecode(executable);
+    if (code == NULL) {
+        guest_memory_error();
+    }
+    uint32_t num_instructions = executable->num_instructions;
 
-    // Entry point, start of instructions
-    executable->entry_point = get_lit_end_int(input_stream, ENTRY_POINT_LEN);
+    // Only branch targets and the entry point need a label.
+    bool *is_target = calloc(num_instructions, sizeof(*is_target));
+    if (is_target == NULL && num_instructions != 0) {
+        guest_memory_error();
+    }
+    bool uses_past_end = false;
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        if (code[i].handler == HANDLER_BEQ || code[i].handler == HANDLER_BNE) {
+            uint32_t target = i + code[i].immediate;
+            if (target < num_instructions) {
+                is_target[target] = true;
+            } else {
+                uses_past_end = true;
+            }
+        }
+    }
 
-    // Store all instructions
-    uint32_t *instructions = malloc(num_instructions * sizeof(uint32_t));
-    for (int i = 0; i < num_instructions; i++) {
-        instructions[i] = get_lit_end_int(input_stream, INSTRUCTIONS_LEN);
+    fprintf(stream, "// Generated by imps --emit-c from %s\n\n", path);
+    fprintf(stream, "#define MEMORY_SIZE %d\n", executable->memory_size);
+    fprintf(stream, "#define STACK_SIZE %" PRIu32 "u\n\n", 
+            (options->stack_size + GUEST_PAGE_SIZE - 1) & 
+            ~(uint32_t)(GUEST_PAGE_SIZE - 1));
+    fputs(emit_c_runtime, stream);
+    fprintf(stream, "\nstatic uint8_t memory[MEMORY_SIZE + 4] = {");
+    for (int i = 0; i < executable->memory_size; i++) {
+        fprintf(stream, "%s%d,", i % EMIT_C_BYTES_PER_LINE == 0 ? "\n    " :
+                " ", executable->initial_data[i]);
+    }
+    fprintf(stream, "\n};\n");
+
+    fprintf(stream, "\nint main(void) {\n");
+    fprintf(stream, "    uint32_t r[32] = {0};\n");
+    fprintf(stream, "    r[%d] = 0x%08xu;\n", GP, GLOBAL_POINTER_START);
+    fprintf(stream, "    r[%d] = 0x%08xu;\n", SP, STACK_POINTER_START);
+    fprintf(stream, "    (void)r;\n");
+    fprintf(stream, "    imps_init();\n");
+    // The loaders only accept an entry point that is an instruction.
+    is_target[executable->entry_point] = true;
+    fprintf(stream, "    goto L%" PRIu32 ";\n", executable->entry_point);
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        if (is_target[i]) {
+            fprintf(stream, "L%" PRIu32 ":\n", i);
+        }
+        emit_c_inst(&code[i], i, num_instructions, stream);
+    }
+    // Only label the error if a branch jumps to it, the last instruction 
+    // falls through to it either way.
+    fprintf(stream, "%s", uses_past_end ? "past_end:\n" : "");
+    fprintf(stream, 
+        "    imps_error(\"execution past the end of instructions\");\n");
+    fprintf(stream, "}\n");
+
+    free(is_target);
+    free(code);
+}
+
+/**
+ * Writes the C statement for a single predecoded instruction.
+ */
+static void emit_c_inst(struct decoded_inst *inst, uint32_t index,
+                        uint32_t num_instructions, FILE *stream) {
+    uint8_t s = inst->source;
+    uint8_t t = inst->target;
+    uint8_t d = inst->destination;
+    uint32_t imm = inst->immediate;
+    fprintf(stream, "    ");
+    switch (inst->handler) {
+    case HANDLER_ADDI:
+        if (t != ZERO_REGISTER) {
+            fprintf(stream, "overflow_check(0x%08" PRIx32 "u, r[%d]); ", imm, 
+                    s);
+            fprintf(stream, "r[%d] = r[%d] + 0x%08" PRIx32 "u;", t, s, imm);
+        }
+        break;
+    case HANDLER_ADDIU:
+        if (t != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = r[%d] + 0x%08" PRIx32 "u;", t, s, imm);
+        }
+        break;
+    case HANDLER_ORI:
+        if (t != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = r[%d] | 0x%08" PRIx32 "u;", t, s, imm);
+        }
+        break;
+    case HANDLER_LUI:
+        if (t != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = 0x%08" PRIx32 "u;", t, imm);
+        }
+        break;
+    case HANDLER_ADD:
+        if (d != ZERO_REGISTER) {
+            fprintf(stream, "overflow_check(r[%d], r[%d]); ", t, s);
+            fprintf(stream, "r[%d] = r[%d] + r[%d];", d, s, t);
+        }
+        break;
+    case HANDLER_ADDU:
+    case HANDLER_MUL:
+        if (d != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = r[%d] %c r[%d];", d, s, 
+                    inst->handler == HANDLER_MUL ? '*' : '+', t);
+        }
+        break;
+    case HANDLER_SLT:
+        if (d != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = (int32_t)r[%d] < (int32_t)r[%d];", 
+                    d, s, t);
+        }
+        break;
+    case HANDLER_CLO:
+    case HANDLER_CLZ:
+        if (d != ZERO_REGISTER) {
+            fprintf(stream, "r[%d] = count_leading_zeros(%sr[%d]);", d, 
+                    inst->handler == HANDLER_CLO ? "~" : "", s);
+        }
+        break;
+    case HANDLER_BEQ:
+    case HANDLER_BNE: {
+        uint32_t target = index + imm;
+        fprintf(stream, "if (r[%d] %s r[%d]) ", s, 
+                inst->handler == HANDLER_BEQ ? "==" : "!=", t);
+        if (target < num_instructions) {
+            fprintf(stream, "goto L%" PRIu32 ";", target);
+        } else {
+            fprintf(stream, "goto past_end;");
+        }
+        break;
+    }
+    case HANDLER_LB:
+    case HANDLER_LH:
+    case HANDLER_LW:
+        if (t == ZERO_REGISTER) {
+            fprintf(stream, "address_check(r[%d] + 0x%08" PRIx32 "u, %d);", 
+                    s, imm, emit_c_access_size(inst->handler));
+            break;
+        }
+        fprintf(stream, "{ uint8_t *p = address_check(r[%d] + 0x%08" PRIx32 
+                "u, %d);", s, imm, emit_c_access_size(inst->handler));
+        fprintf(stream, " r[%d] = load_%s(p); }", t, 
+                emit_c_access_name(inst->handler));
+        break;
+    case HANDLER_SB:
+    case HANDLER_SH:
+    case HANDLER_SW:
+        fprintf(stream, "{ uint8_t *p = address_check(r[%d] + 0x%08" PRIx32 
+                "u, %d);", s, imm, emit_c_access_size(inst->handler));
+        fprintf(stream, " store_%s(p, r[%d]); }", 
+                emit_c_access_name(inst->handler), t);
+        break;
+    case HANDLER_SYSCALL:
+        fprintf(stream, "imps_syscall(r);");
+        break;
+    default:
+        fprintf(stream, "bad_instruction(0x%08" PRIx32 "u);", imm);
+    }
+    fprintf(stream, "\n");
+}
+
+/**
+ * Returns the number of bytes accessed by a load or store handler.
+ */
+static int emit_c_access_size(uint8_t handler) {
+    if (handler == HANDLER_LB || handler == HANDLER_SB) {
+        return BYTE_LEN;
+    } else if (handler == HANDLER_LH || handler == HANDLER_SH) {
+        return HALF_WORD_LEN;
+    }
+    return WORD_LEN;
+}
+
+/**
+ * Returns the name used by the runtime helpers for a load or store handler.
+ */
+static const char *emit_c_access_name(uint8_t handler) {
+    if (handler == HANDLER_LB || handler == HANDLER_SB) {
+        return "byte";
+    } else if (handler == HANDLER_LH || handler == HANDLER_SH) {
+        return "half";
+    }
+    return "word";
+}
+
+/**
+ * Sets up --profile for an executable. Every instruction run is counted and
+ * the report and generated superinstructions are written out when the 
+ * program exits, however it exits.
+ */
+static void start_profile(struct imps_file *executable, char *path,
+                          char *header_path) {
+    struct profile *profile = malloc(sizeof(*profile));
+    if (profile == NULL) {
+        guest_memory_error();
+    }
+    profile->program_path = path;
+    profile->header_path = header_path;
+    profile->num_instructions = executable->num_instructions;
+    profile->code = predecode(executable);
+    if (profile->code == NULL) {
+        guest_memory_error();
+    }
+    profile->counts = calloc(executable->num_instructions, 
+                             sizeof(*profile->counts));
+    if (profile->counts == NULL && executable->num_instructions != 0) {
+        guest_memory_error();
+    }
+    active_profile = profile;
+    atexit(finish_profile);
+}
+
+/**
+ * Prints the instruction sequences that would save the most dispatches if
+ * fused to stderr, and writes the best ones that are not already built in
+ * to the header file as generated superinstructions.
+ */
+static void finish_profile(void) {
+    struct profile *profile = active_profile;
+    uint32_t num_sequences;
+    struct sequence *sequences = collect_sequences(profile, &num_sequences);
+    qsort(sequences, num_sequences, sizeof(*sequences), 
+          compare_sequence_savings);
+
+    fprintf(stderr, "Most executed instruction sequences in %s:\n", 
+            profile->program_path);
+    fprintf(stderr, "%12s %12s  %s\n", "executions", "saved", "sequence");
+    for (uint32_t i = 0; i < num_sequences && i < PROFILE_REPORT_LEN; i++) {
+        struct sequence *sequence = &sequences[i];
+        fprintf(stderr, "%12" PRIu64 " %12" PRIu64 "  ", sequence->count, 
+                sequence->count * (sequence->length - 1));
+        print_sequence(stderr, sequence, " ", false);
+        if (sequence->length == 2 && 
+            fused_handler(sequence->key & PROFILE_HANDLER_MASK, 
+                          sequence->key >> PROFILE_HANDLER_BITS) 
+                != HANDLER_BAD) {
+            fprintf(stderr, " (built in)");
+        }
+        putc('\n', stderr);
+    }
+    write_superinstructions(profile, sequences, num_sequences);
+
+    free(sequences);
+    free(profile->counts);
+    free(profile->code);
+    free(profile);
+    active_profile = NULL;
+}
+
+/**
+ * Returns every straight line sequence of PROFILE_MIN_LENGTH to 
+ * PROFILE_MAX_LENGTH instructions that was executed, with its execution 
+ * count summed over every place it appears. Only the last instruction of a
+ * sequence can be a branch and none can be a syscall or bad instruction, the
+ * same rule superinstructions follow. Such a sequence always runs to the end
+ * once started, so it was executed as often as its first instruction.
+ */
+static struct sequence *collect_sequences(struct profile *profile,
+                                          uint32_t *num_sequences) {
+    struct decoded_inst *code = profile->code;
+    uint32_t num_instructions = profile->num_instructions;
+    struct sequence *sequences = malloc(
+        ((size_t)num_instructions * (PROFILE_MAX_LENGTH - 1) + 1) * 
+        sizeof(*sequences));
+    uint32_t num = 0;
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        if (profile->counts[i] == 0) {
+            continue;
+        }
+        uint32_t key = code[i].handler;
+        for (uint32_t length = PROFILE_MIN_LENGTH; 
+             length <= PROFILE_MAX_LENGTH; length++) {
+            uint32_t last = i + length - 1;
+            if (last >= num_instructions || 
+                ends_block(code[last - 1].handler) ||
+                code[last].handler == HANDLER_SYSCALL || 
+                code[last].handler == HANDLER_BAD) {
+                break;
+            }
+            key |= (uint32_t)code[last].handler << 
+                   (PROFILE_HANDLER_BITS * (length - 1));
+            sequences[num].key = key;
+            sequences[num].length = length;
+            sequences[num].count = profile->counts[i];
+            num++;
+        }
+    }
+
+    // Merge the counts of identical sequences.
+    qsort(sequences, num, sizeof(*sequences), compare_sequence_keys);
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        if (merged > 0 && sequences[merged - 1].key == sequences[i].key &&
+            sequences[merged - 1].length == sequences[i].length) {
+            sequences[merged - 1].count += sequences[i].count;
+        } else {
+            sequences[merged] = sequences[i];
+            merged++;
+        }
+    }
+    *num_sequences = merged;
+    return sequences;
+}
+
+/**
+ * qsort comparison putting identical sequences next to each other.
+ */
+static int compare_sequence_keys(const void *first, const void *second) {
+    const struct sequence *a = first;
+    const struct sequence *b = second;
+    if (a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    } else if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * qsort comparison putting the sequence that saves the most dispatches when
+ * fused first.
+ */
+static int compare_sequence_savings(const void *first, const void *second) {
+    const struct sequence *a = first;
+    const struct sequence *b = second;
+    uint64_t saved_a = a->count * (a->length - 1);
+    uint64_t saved_b = b->count * (b->length - 1);
+    if (saved_a != saved_b) {
+        return saved_a > saved_b ? -1 : 1;
+    }
+    return compare_sequence_keys(first, second);
+}
+
+/**
+ * Prints the instruction names of a sequence, separated by 'separator'.
+ */
+static void print_sequence(FILE *stream, struct sequence *sequence, 
+                           const char *separator, bool upper_case) {
+    for (uint32_t i = 0; i < sequence->length; i++) {
+        uint8_t handler = (sequence->key >> (PROFILE_HANDLER_BITS * i)) & 
+                          PROFILE_HANDLER_MASK;
+        if (i > 0) {
+            fputs(separator, stream);
+        }
+        for (const char *c = handler_names[handler]; *c != '\0'; c++) {
+            putc(upper_case ? toupper(*c) : *c, stream);
+        }
+    }
+}
+
+/**
+ * Writes the header consumed by -DIMPS_SUPERINSTRUCTIONS, defining a 
+ * superinstruction for each of the first PROFILE_MAX_FUSED sequences that is
+ * not a built in pair.
+ */
+static void write_superinstructions(struct profile *profile, 
+                                    struct sequence *sequences, 
+                                    uint32_t num_sequences) {
+    FILE *stream = fopen(profile->header_path, "w");
+    if (stream == NULL) {
+        fprintf(stderr, "IMPS error: could not write %s\n", 
+                profile->header_path);
+        return;
+    }
+    fprintf(stream, "// Superinstructions generated by imps --profile from "
+                    "%s.\n", profile->program_path);
+    fprintf(stream, "// Build imps with -DIMPS_SUPERINSTRUCTIONS='\"%s\"' "
+                    "to use them.\n", profile->header_path);
+    fprintf(stream, "#define GENERATED_SUPERINSTRUCTIONS(X) \\\n");
+    int written = 0;
+    for (uint32_t i = 0; i < num_sequences && written < PROFILE_MAX_FUSED; 
+         i++) {
+        struct sequence *sequence = &sequences[i];
+        if (sequence->length == 2 && 
+            fused_handler(sequence->key & PROFILE_HANDLER_MASK, 
+                          sequence->key >> PROFILE_HANDLER_BITS) 
+                != HANDLER_BAD) {
+            continue;
+        }
+        fprintf(stream, "    X(");
+        print_sequence(stream, sequence, "_", true);
+        fprintf(stream, ", %" PRIu32 ", ", sequence->length);
+        print_sequence(stream, sequence, ", ", true);
+        for (uint32_t part = sequence->length; part < PROFILE_MAX_LENGTH; 
+             part++) {
+            fprintf(stream, ", NONE");
+        }
+        fprintf(stream, ") \\\n");
+        written++;
+    }
+    fprintf(stream, "\n");
+    fclose(stream);
+}
+#endif
+
+#ifndef IMPS_LIBRARY
+/**
+ * Reads an IMPS exectuable file from the file at 'path' into 'executable'.
+ * Exists the program if the file can't be accessed or is not well-formed.
+ */
+void read_imps_file(char *path, struct imps_file *executable) {
+    read_executable(path, executable, true);
+}
+
+/**
+ * Reads an IMPS executable like read_imps_file. The debug offsets are only 
+ * used by trace mode, so unless 'debug' is set they are skipped and left 
+ * NULL. Every section is checked against the length of the file before 
+ * anything is allocated for it.
+ */
+static void read_executable(char *path, struct imps_file *executable, 
+                            bool debug) {
+    FILE *input_stream = fopen(path, "r");
+    if (input_stream == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    check_magic_number(input_stream);
+    int64_t remaining = remaining_bytes(input_stream);
+    uint64_t needed = INSTRUCTIONS_LEN + ENTRY_POINT_LEN;
+    check_section(input_stream, remaining, needed, "header");
+
+    // Number of instructions
+    uint32_t num_instructions = get_lit_end_int(input_stream, INSTRUCTIONS_LEN);
+    executable->num_instructions = num_instructions;
+
+    // Entry point, start of instructions
+    executable->entry_point = get_lit_end_int(input_stream, ENTRY_POINT_LEN);
+    if (executable->entry_point >= num_instructions) {
+        invalid_imps_file(input_stream, 
+                          "entry point %" PRIu32 " is not one of the %" 
+                          PRIu32 " instructions", 
+                          executable->entry_point, num_instructions);
+    }
+    needed += (uint64_t)num_instructions * INSTRUCTIONS_LEN;
+    check_section(input_stream, remaining, needed, "instructions");
+    needed += (uint64_t)num_instructions * DEBUG_OFFSET_LEN;
+    check_section(input_stream, remaining, needed, "debug offsets");
+    needed += MEMORY_SIZE_LEN;
+    check_section(input_stream, remaining, needed, "memory size");
+
+    // Store all instructions
+    uint32_t *instructions = malloc(num_instructions * sizeof(uint32_t));
+    uint32_t *debug_offsets = NULL;
+    if (debug) {
+        debug_offsets = malloc(num_instructions * sizeof(uint32_t));
+    }
+    if (instructions == NULL || (debug && debug_offsets == NULL)) {
+        invalid_imps_file(input_stream, 
+                          "no memory for %" PRIu32 " instructions", 
+                          num_instructions);
+    }
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        instructions[i] = get_lit_end_int(input_stream, INSTRUCTIONS_LEN);
+    }
+    executable->instructions = instructions;
+
+    // Store all debug offsets, or skip over them. A file that can't be 
+    // seeked in is read through instead.
+    if (debug) {
+        for (uint32_t i = 0; i < num_instructions; i++) {
+            debug_offsets[i] = get_lit_end_int(input_stream, DEBUG_OFFSET_LEN);
+        }
+    } else if (remaining < 0 || 
+               fseek(input_stream, 
+                     (long)num_instructions * DEBUG_OFFSET_LEN, 
+                     SEEK_CUR) != 0) {
+        for (uint32_t i = 0; i < num_instructions; i++) {
+            get_lit_end_int(input_stream, DEBUG_OFFSET_LEN);
+        }
+    }
+    executable->debug_offsets = debug_offsets;
+
+    // Get the memory size
+    executable->memory_size = 
+        get_lit_end_int(input_stream, MEMORY_SIZE_LEN) & UINT16_MASK;   
+    needed += executable->memory_size;
+    check_section(input_stream, remaining, needed, "initial data");
+
+    // Store all initial data
+    uint8_t *initial_data = malloc(executable->memory_size > 0 ? 
+                                   executable->memory_size : 1);
+    if (initial_data == NULL) {
+        free(instructions);
+        free(debug_offsets);
+        invalid_imps_file(input_stream, 
+                          "no memory for %" PRIu32 " bytes of initial data",
+                          (uint32_t)executable->memory_size);
+    }
+    if (fread(initial_data, sizeof(uint8_t), executable->memory_size, 
+              input_stream) != executable->memory_size) {
+        invalid_imps_file(input_stream, "file ends inside the initial data");
+    }
+    executable->initial_data = initial_data;
+
+    fclose(input_stream);
+}
+
+/**
+ * Checks the magic number of a given file to determine whether the file path
+ * is valid. Exits if invalid with an error.
+ */
+static void check_magic_number(FILE *input_stream) {
+    uint8_t valid_check[MAGIC_NUM_SIZE];
+    if (fread(valid_check, 1, sizeof(valid_check), input_stream) != 
+        MAGIC_NUM_SIZE || 
+        valid_check[0] != MAGIC_BYTE_0 || valid_check[1] != MAGIC_BYTE_1 ||
+        valid_check[2] != MAGIC_BYTE_2 || valid_check[3] != MAGIC_BYTE_3) {
+            fprintf(stderr, "Invalid IMPS file\n");
+            fclose(input_stream);
+            exit(EXIT_FAILURE);
+    }    
+}
+
+/**
+ * Helper function used to return a little endian unsigned integer given a 
+ * position in the file.
+ */
+static uint32_t get_lit_end_int(FILE *input_stream, int num_bytes) {
+    uint32_t num = 0;
+    for (int i = 0; i < num_bytes; i++) {
+        int byte = fgetc(input_stream);
+        if (byte == EOF) {
+            invalid_imps_file(input_stream, "unexpected end of file");
+        }
+        num |= (uint32_t)byte << (BYTE_SIZE * i);
+    }
+    return num;
+}
+
+/**
+ * Returns the number of bytes left in the file from the current position, or
+ * -1 if the file can't be measured, like a pipe. Such files are only checked
+ * as they are read.
+ */
+static int64_t remaining_bytes(FILE *input_stream) {
+    long position = ftell(input_stream);
+    if (position < 0 || fseek(input_stream, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    long end = ftell(input_stream);
+    if (end < 0 || fseek(input_stream, position, SEEK_SET) != 0) {
+        return -1;
+    }
+    return end - position;
+}
+
+/**
+ * Exits with an error naming 'section' if the 'needed' bytes following the 
+ * magic number, up to and including that section, are not all in the file.
+ */
+static void check_section(FILE *input_stream, int64_t remaining, 
+                          uint64_t needed, const char *section) {
+    if (remaining >= 0 && (uint64_t)remaining < needed) {
+        invalid_imps_file(input_stream, 
+                          "file ends inside the %s (%" PRIu64 " bytes "
+                          "needed after the magic number, %" PRId64 
+                          " present)", section, needed, remaining);
+    }
+}
+
+/**
+ * Prints why a file is not a valid IMPS file, then closes it and exits.
+ */
+static void invalid_imps_file(FILE *input_stream, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Invalid IMPS file: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    fclose(input_stream);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Loads the executable at 'path' and its predecoded instructions into 
+ * 'image'. If 'cache_dir' is given, both are mapped from the translation 
+ * cache when it holds this executable, and stored there otherwise. The debug
+ * offsets may be left out unless 'debug' is set.
+ */
+static void load_imps_file(char *path, char *cache_dir, bool debug,
+                           struct imps_file *executable, 
+                           struct loaded_image *image) {
+#ifdef IMPS_CACHE
+    char *cache_path = NULL;
+    uint64_t key = 0;
+    if (cache_dir != NULL) {
+        cache_path = cache_file_path(path, cache_dir, &key);
+    }
+    if (cache_path != NULL && 
+        map_cache_file(cache_path, key, executable, image)) {
+        free(cache_path);
+        return;
+    }
+    // The cache stores the debug offsets too.
+    debug = debug || cache_path != NULL;
+#else
+    (void)cache_dir;
+#endif
+#ifdef IMPS_MMAP
+    if (!map_imps_file(path, debug, executable, image)) {
+        read_executable(path, executable, debug);
+    }
+#else
+    read_executable(path, executable, debug);
+#endif
+    image->code = predecode(executable);
+    if (image->code == NULL) {
+        guest_memory_error();
+    }
+#ifdef IMPS_CACHE
+    if (cache_path != NULL) {
+        write_cache_file(cache_path, key, executable, image->code);
+        free(cache_path);
+    }
+#endif
+}
+
+/**
+ * Frees an executable loaded by load_imps_file.
+ */
+static void free_imps_file(struct imps_file *executable, 
+                           struct loaded_image *image) {
+#ifdef IMPS_MMAP
+    if (image->mapping != NULL) {
+        munmap(image->mapping, image->mapping_size);
+        if (!image->cached) {
+            free(image->code);
+        }
+        return;
+    }
+#endif
+    free(executable->debug_offsets);
+    free(executable->instructions);
+    free(executable->initial_data);
+    free(image->code);
+}
+
+#ifdef IMPS_MMAP
+/**
+ * Maps the executable at 'path' and points the instruction, debug offset and
+ * initial data arrays of 'executable' straight into the file. The mapping is
+ * private, so stores to the initial data never reach the file, and on big 
+ * endian hosts the arrays are byte swapped in place. Pages are only read in
+ * when touched, so unused debug offsets cost nothing; on big endian hosts
+ * they are only swapped, and otherwise left NULL, if 'debug' is set. Returns
+ * false, leaving the file to read_executable and its error messages, unless
+ * the file is a well-formed IMPS file.
+ */
+static bool map_imps_file(char *path, bool debug, 
+                          struct imps_file *executable, 
+                          struct loaded_image *image) {
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        return false;
+    }
+    struct stat info;
+    uint8_t *mapping = MAP_FAILED;
+    if (fstat(fileno(stream), &info) == 0 && info.st_size > 0) {
+        mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE, fileno(stream), 0);
+    }
+    fclose(stream);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    char message[IMPS_MESSAGE_LEN];
+    if (!parse_executable(mapping, info.st_size, debug, executable, message,
+                          sizeof(message))) {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+    image->mapping = mapping;
+    image->mapping_size = info.st_size;
+    return true;
+}
+#endif
+#endif
+
+/**
+ * Fills in 'executable' from the 'size' bytes of an IMPS file at 'bytes', 
+ * pointing into them rather than copying anything. On big endian hosts the
+ * arrays are byte swapped in place, the debug offsets only if 'debug' is set
+ * and otherwise left NULL. Returns false, with the reason in 'message', 
+ * unless the bytes are a well-formed IMPS file.
+ */
+static bool parse_executable(uint8_t *bytes, uint64_t size, bool debug,
+                             struct imps_file *executable, char *message,
+                             size_t message_size) {
+    // The header is the magic number, the number of instructions and the 
+    // entry point. The instructions and debug offsets come next, then the 
+    // memory size and the initial data.
+    if (size < MAGIC_NUM_SIZE || bytes[0] != MAGIC_BYTE_0 || 
+        bytes[1] != MAGIC_BYTE_1 || bytes[2] != MAGIC_BYTE_2 || 
+        bytes[3] != MAGIC_BYTE_3) {
+        snprintf(message, message_size, "bad magic number");
+        return false;
+    }
+    uint64_t remaining = size - MAGIC_NUM_SIZE;
+    uint64_t needed = INSTRUCTIONS_LEN + ENTRY_POINT_LEN;
+    if (!section_fits(remaining, needed, "header", message, message_size)) {
+        return false;
+    }
+    uint32_t num_instructions = 
+        read_lit_end_int(bytes + MAGIC_NUM_SIZE, INSTRUCTIONS_LEN);
+    uint32_t entry_point = 
+        read_lit_end_int(bytes + MAGIC_NUM_SIZE + INSTRUCTIONS_LEN, 
+                         ENTRY_POINT_LEN);
+    if (entry_point >= num_instructions) {
+        snprintf(message, message_size, 
+                 "entry point %" PRIu32 " is not one of the %" PRIu32 
+                 " instructions", entry_point, num_instructions);
+        return false;
+    }
+    needed += (uint64_t)num_instructions * INSTRUCTIONS_LEN;
+    if (!section_fits(remaining, needed, "instructions", message, 
+                      message_size)) {
+        return false;
+    }
+    needed += (uint64_t)num_instructions * DEBUG_OFFSET_LEN;
+    if (!section_fits(remaining, needed, "debug offsets", message, 
+                      message_size)) {
+        return false;
+    }
+    uint64_t memory_offset = MAGIC_NUM_SIZE + needed;
+    needed += MEMORY_SIZE_LEN;
+    if (!section_fits(remaining, needed, "memory size", message, 
+                      message_size)) {
+        return false;
+    }
+    uint16_t memory_size = 
+        read_lit_end_int(bytes + memory_offset, MEMORY_SIZE_LEN);
+    needed += memory_size;
+    if (!section_fits(remaining, needed, "initial data", message, 
+                      message_size)) {
+        return false;
+    }
+
+    uint32_t *instructions = 
+        (uint32_t *)(bytes + MAGIC_NUM_SIZE + INSTRUCTIONS_LEN + 
+                     ENTRY_POINT_LEN);
+    uint32_t *debug_offsets = instructions + num_instructions;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        instructions[i] = __builtin_bswap32(instructions[i]);
+    }
+    if (debug) {
+        for (uint32_t i = 0; i < num_instructions; i++) {
+            debug_offsets[i] = __builtin_bswap32(debug_offsets[i]);
+        }
+    } else {
+        debug_offsets = NULL;
+    }
+#else
+    (void)debug;
+#endif
+    executable->num_instructions = num_instructions;
+    executable->entry_point = entry_point;
+    executable->instructions = instructions;
+    executable->debug_offsets = debug_offsets;
+    executable->memory_size = memory_size;
+    executable->initial_data = bytes + memory_offset + MEMORY_SIZE_LEN;
+    return true;
+}
+
+/**
+ * Returns false, with the reason in 'message', if the 'needed' bytes 
+ * following the magic number, up to and including 'section', are not all 
+ * among the 'remaining' bytes.
+ */
+static bool section_fits(uint64_t remaining, uint64_t needed, 
+                         const char *section, char *message, 
+                         size_t message_size) {
+    if (remaining < needed) {
+        snprintf(message, message_size, 
+                 "file ends inside the %s (%" PRIu64 " bytes needed after "
+                 "the magic number, %" PRIu64 " present)", section, needed, 
+                 remaining);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the little endian unsigned integer stored at 'bytes'.
+ */
+static uint32_t read_lit_end_int(uint8_t *bytes, int num_bytes) {
+    uint32_t num = 0;
+    for (int i = 0; i < num_bytes; i++) {
+        num |= (uint32_t)bytes[i] << (BYTE_SIZE * i);
+    }
+    return num;
+}
+
+#ifdef IMPS_CACHE
+/**
+ * Hashes the executable at 'path' together with the emulator version into 
+ * 'key' and returns the path of its file in 'cache_dir', or NULL if the 
+ * executable can't be read.
+ */
+static char *cache_file_path(char *path, char *cache_dir, uint64_t *key) {
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fileno(stream), &info) != 0) {
+        fclose(stream);
+        return NULL;
+    }
+    char *cache_path = NULL;
+    if (info.st_size > 0) {
+        uint8_t *contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, 
+                                 fileno(stream), 0);
+        if (contents != MAP_FAILED) {
+            cache_path = cache_key_path(contents, info.st_size, cache_dir, 
+                                        key);
+            munmap(contents, info.st_size);
+        }
+    } else {
+        cache_path = cache_key_path(NULL, 0, cache_dir, key);
+    }
+    fclose(stream);
+    return cache_path;
+}
+
+/**
+ * Like cache_file_path, for the 'size' bytes of an executable already read
+ * into 'bytes'.
+ */
+static char *cache_key_path(const uint8_t *bytes, size_t size, 
+                            char *cache_dir, uint64_t *key) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t format = CACHE_FORMAT;
+    hash = hash_bytes(hash, IMPS_VERSION, strlen(IMPS_VERSION));
+    hash = hash_bytes(hash, &format, sizeof(format));
+    if (size > 0) {
+        hash = hash_bytes(hash, bytes, size);
+    }
+    *key = hash;
+    size_t length = strlen(cache_dir) + sizeof("/0123456789abcdef.impc");
+    char *cache_path = malloc(length);
+    if (cache_path != NULL) {
+        snprintf(cache_path, length, "%s/%016" PRIx64 ".impc", cache_dir, 
+                 hash);
+    }
+    return cache_path;
+}
+
+/**
+ * Maps the cache file at 'cache_path' and points 'executable' and 'image' 
+ * into it. The mapping is private, so stores to the initial data never reach
+ * the file. Returns false if there is no valid cache file for 'key'.
+ */
+static bool map_cache_file(char *cache_path, uint64_t key, 
+                           struct imps_file *executable, 
+                           struct loaded_image *image) {
+    FILE *stream = fopen(cache_path, "rb");
+    if (stream == NULL) {
+        return false;
+    }
+    struct stat info;
+    uint8_t *mapping = MAP_FAILED;
+    if (fstat(fileno(stream), &info) == 0 && 
+        (uint64_t)info.st_size >= sizeof(struct cache_header)) {
+        mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE, fileno(stream), 0);
+    }
+    fclose(stream);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    struct cache_header *header = (struct cache_header *)mapping;
+    uint32_t num_instructions = header->num_instructions;
+    if (memcmp(header->magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0 || 
+        header->format != CACHE_FORMAT || header->key != key ||
+        (uint64_t)info.st_size != 
+            cache_file_size(num_instructions, header->memory_size) ||
+        !cached_code_valid((struct decoded_inst *)(mapping + sizeof(*header)),
+                           num_instructions, header->entry_point, 
+                           header->memory_size)) {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+
+    uint8_t *position = mapping + sizeof(*header);
+    image->code = (struct decoded_inst *)position;
+    position += (num_instructions + 1) * sizeof(struct decoded_inst);
+    executable->instructions = (uint32_t *)position;
+    position += num_instructions * sizeof(uint32_t);
+    executable->debug_offsets = (uint32_t *)position;
+    position += num_instructions * sizeof(uint32_t);
+    executable->initial_data = position;
+    executable->num_instructions = num_instructions;
+    executable->entry_point = header->entry_point;
+    executable->memory_size = header->memory_size;
+    image->mapping = mapping;
+    image->mapping_size = info.st_size;
+    image->cached = true;
+    return true;
+}
+
+/**
+ * Stores 'executable' and its predecoded instructions as the cache file at 
+ * 'cache_path'. The file is written under a temporary name and renamed into 
+ * place, so a concurrent run never maps half a file. Failing to write the 
+ * cache is not an error.
+ */
+static void write_cache_file(char *cache_path, uint64_t key, 
+                             struct imps_file *executable, 
+                             struct decoded_inst *code) {
+    uint32_t num_instructions = executable->num_instructions;
+    struct cache_header header = {0};
+    memcpy(header.magic, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+    header.format = CACHE_FORMAT;
+    header.key = key;
+    header.num_instructions = num_instructions;
+    header.entry_point = executable->entry_point;
+    header.memory_size = executable->memory_size;
+
+    size_t length = strlen(cache_path) + sizeof(".XXXXXX");
+    char *temp_path = malloc(length);
+    if (temp_path == NULL) {
+        return;
+    }
+    snprintf(temp_path, length, "%s.XXXXXX", cache_path);
+    int temp_fd = mkstemp(temp_path);
+    FILE *stream = temp_fd < 0 ? NULL : fdopen(temp_fd, "wb");
+    if (stream == NULL) {
+        if (temp_fd >= 0) {
+            remove(temp_path);
+        }
+        free(temp_path);
+        return;
+    }
+    bool written = 
+        fwrite(&header, sizeof(header), 1, stream) == 1 &&
+        fwrite(code, sizeof(*code), num_instructions + 1, stream) == 
+            num_instructions + 1 &&
+        fwrite(executable->instructions, sizeof(uint32_t), num_instructions, 
+               stream) == num_instructions &&
+        fwrite(executable->debug_offsets, sizeof(uint32_t), num_instructions,
+               stream) == num_instructions &&
+        fwrite(executable->initial_data, 1, executable->memory_size, 
+               stream) == executable->memory_size;
+    if (fclose(stream) != 0 || !written || rename(temp_path, cache_path) != 0) {
+        remove(temp_path);
+    }
+    free(temp_path);
+}
+
+/**
+ * Checks the header fields and predecoded instructions of a cache file as 
+ * closely as a freshly loaded executable is checked: the entry point and 
+ * memory size as read_executable checks them, and the registers, branch 
+ * targets and sentinel as decode_inst and verify_code leave them. A damaged
+ * file, or one written by a different build, is then a miss rather than 
+ * running an unknown handler or branching past the sentinel. Only 
+ * instructions as predecode leaves them are accepted, never fused ones.
+ */
+static bool cached_code_valid(struct decoded_inst *code, 
+                              uint32_t num_instructions, 
+                              uint32_t entry_point, uint32_t memory_size) {
+    if (entry_point >= num_instructions || memory_size > UINT16_MASK ||
+        code[num_instructions].handler != HANDLER_PAST_END) {
+        return false;
+    }
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        if (code[i].handler > HANDLER_SW || 
+            code[i].source >= NUM_REGISTERS || 
+            code[i].target >= NUM_REGISTERS ||
+            code[i].destination >= NUM_REGISTERS) {
+            return false;
+        }
+        if ((code[i].handler == HANDLER_BEQ || 
+             code[i].handler == HANDLER_BNE) &&
+            i + code[i].immediate > num_instructions) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns the size of a cache file holding an executable with the given
+ * number of instructions and bytes of initial data.
+ */
+static uint64_t cache_file_size(uint32_t num_instructions, 
+                                uint32_t memory_size) {
+    return sizeof(struct cache_header) + 
+           ((uint64_t)num_instructions + 1) * sizeof(struct decoded_inst) +
+           (uint64_t)num_instructions * 2 * sizeof(uint32_t) + memory_size;
+}
+
+/**
+ * Folds 'length' bytes into a 64 bit FNV-1a hash.
+ */
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t length) {
+    const uint8_t *byte = bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ byte[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+#endif
+
+#ifndef IMPS_LIBRARY
+/**
+ * Execute an IMPS program, determines required instructions and executes
+ * corresponding required functions and memory access.
+ */
+void execute_imps(struct imps_file *executable, int trace_mode, char *path) {
+    struct run_options options = {TIER_THREADED_AFTER, TIER_JIT_AFTER, false,
+                                  STACK_DEFAULT_SIZE};
+    struct decoded_inst *code = predecode(executable);
+    if (code == NULL) {
+        guest_memory_error();
+    }
+    run_imps(executable, code, trace_mode, path, &options);
+    free(code);
+}
+
+/**
+ * Runs an IMPS program like execute_imps, given its predecoded instructions 
+ * 'code' and the tier thresholds in 'options'.
+ */
+static void run_imps(struct imps_file *executable, struct decoded_inst *code,
+                     int trace_mode, char *path, struct run_options *options) {
+    // Initialise register and run time data.
+    struct runtime_data *data = create_data(code, executable, options);
+    if (data == NULL) {
+        guest_memory_error();
+    }
+
+    // Initialise file system in memory.
+    struct file *files = malloc(MAX_FILE_NUM * sizeof(*files));
+    struct descriptor *descriptors = 
+        malloc(MAX_DESC_NUM * sizeof(*descriptors));
+    initialise_files(files, descriptors);
+
+    // The run only ends by jumping back here.
+    // Trace output goes to stdout through stdio, so the guest's output has to
+    // go the same way to stay in order with it. Without memory for the 
+    // buffer it goes through stdio too.
+    struct output_buffer *output = NULL;
+    if (trace_mode != 1) {
+        output = malloc(sizeof(*output));
+    }
+    if (output != NULL) {
+        output->length = 0;
+        data->write = buffered_write;
+        data->read = buffered_read;
+        data->io_context = output;
+    }
+
+    jmp_buf escape;
+    data->escape = &escape;
+    int status = setjmp(escape);
+    if (status == 0) {
+        // Trace and profile mode need to run code around every instruction,
+        // so they always use the switch loop and never see 
+        // superinstructions.
+        if (trace_mode != 1 && trace_mode != PROFILE_MODE) {
+            run_blocks(data, executable, files, descriptors, options, 0);
+        }
+        run_switch(data, executable, files, descriptors, trace_mode, path);
+    }
+    if (output != NULL) {
+        flush_output(output);
+        free(output);
+    }
+    if (status == IMPS_ERROR || status == IMPS_NO_MEMORY) {
+        fprintf(stderr, "IMPS error: %s\n", data->message);
+    }
+    free_data(data, files, descriptors);
+    exit(status == IMPS_EXITED ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Exits with an error when there is no memory to set up a run.
+ */
+_Noreturn static void guest_memory_error(void) {
+    fprintf(stderr, "IMPS error: could not reserve guest memory\n");
+    exit(EXIT_FAILURE);
+}
+#endif
+
+/**
+ * Returns new run time data for running 'code' from the entry point of 
+ * 'executable' with stdin and stdout, in fresh memory laid out as 'options'
+ * asks, or NULL if there is no memory for it. The executable itself
+ * is left untouched, so it can be run again, or by several runs at once.
+ */
+static struct runtime_data *create_data(struct decoded_inst *code,
+                                        struct imps_file *executable,
+                                        struct run_options *options) {
+    struct runtime_data *data = malloc(sizeof(*data));
+    if (data == NULL) {
+        return NULL;
+    }
+    data->registers = calloc(NUM_REGISTERS, sizeof(uint32_t));
+    data->prev_registers = calloc(NUM_REGISTERS, sizeof(uint32_t));
+    data->code = code;
+    data->sparse = options->sparse_memory;
+    data->stack_bottom = STACK_TOP - 
+        ((options->stack_size + GUEST_PAGE_SIZE - 1) & 
+         ~(uint32_t)(GUEST_PAGE_SIZE - 1));
+    if (data->registers == NULL || data->prev_registers == NULL ||
+        !create_memory(data, executable)) {
+        free(data->registers);
+        free(data->prev_registers);
+        free(data);
+        return NULL;
+    }
+    // As in SPIM and MARS.
+    data->registers[SP] = STACK_POINTER_START;
+    data->registers[GP] = GLOBAL_POINTER_START;
+    data->index = executable->entry_point;
+    data->write = stdio_write;
+    data->read = stdio_read;
+    data->io_context = NULL;
+    data->escape = NULL;
+    data->message[0] = '\0';
+    data->num_instructions = executable->num_instructions;
+    data->blocks = NULL;
+    data->fused = NULL;
+#ifdef IMPS_THREADED
+    data->threaded = NULL;
+#endif
+    data->chain = true;
+#ifdef IMPS_JIT
+    data->jit = NULL;
+    data->jit_failed = false;
+#endif
+    return data;
+}
+
+/**
+ * Sets up the memory of 'data' as a private copy of the initial data of 
+ * 'executable'. The data segment is at most 64 KiB, so copying it is cheaper
+ * than setting up a mapping of the file.
+ *
+ * The copy is padded to whole pages, which are entered in the page table 
+ * from MEMORY_START. With IMPS_GUARD_MEMORY it is instead placed to end 
+ * exactly where the first GUARD_DATA_SIZE bytes of a reservation do. That is
+ * a page boundary on any host with pages of up to 64 KiB, which also holds 
+ * the largest data segment, and every 32 bit offset from the copy is inside
+ * the reservation, so any access outside the data segment faults unless the
+ * memory is sparse, when the whole reservation is accessible. The heap 
+ * arena starts at the host page HEAP_START is in, and the stack is made 
+ * accessible from the GUARD_DATA_SIZE boundary of the reservation at or 
+ * below its bottom up to the one at or above STACK_TOP. Returns false,
+ * with nothing left allocated, if the memory can't be set up.
+ */
+static bool create_memory(struct runtime_data *data, 
+                          struct imps_file *executable) {
+    uint32_t memory_size = executable->memory_size;
+#ifdef IMPS_GUARD_MEMORY
+    install_guard_handler();
+    data->memory_mapping_size = GUARD_RESERVATION + GUARD_DATA_SIZE;
+    data->memory_mapping = mmap(NULL, data->memory_mapping_size, PROT_NONE, 
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+    if (data->memory_mapping == MAP_FAILED) {
+        return false;
+    }
+    if (mprotect(data->memory_mapping, 
+                 data->sparse ? data->memory_mapping_size : GUARD_DATA_SIZE,
+                 PROT_READ | PROT_WRITE) != 0) {
+        munmap(data->memory_mapping, data->memory_mapping_size);
+        return false;
+    }
+    data->memory = data->memory_mapping + GUARD_DATA_SIZE - memory_size;
+    data->heap = data->memory_mapping + 
+        ((HEAP_START - MEMORY_START + GUARD_DATA_SIZE - memory_size) & 
+         ~(size_t)(sysconf(_SC_PAGESIZE) - 1));
+    size_t stack_start = 
+        (data->stack_bottom - MEMORY_START + GUARD_DATA_SIZE - memory_size) &
+        ~(size_t)(GUARD_DATA_SIZE - 1);
+    size_t stack_end = 
+        (STACK_TOP - MEMORY_START + 2 * GUARD_DATA_SIZE - 1 - memory_size) &
+        ~(size_t)(GUARD_DATA_SIZE - 1);
+    data->stack = data->memory_mapping + stack_start;
+    data->stack_length = stack_end - stack_start;
+    data->direct_stack = data->memory + (data->stack_bottom - MEMORY_START);
+    data->direct_stack_length = STACK_TOP - data->stack_bottom;
+    if (!data->sparse && 
+        mprotect(data->stack, data->stack_length, 
+                 PROT_READ | PROT_WRITE) != 0) {
+        munmap(data->memory_mapping, data->memory_mapping_size);
+        return false;
+    }
+    data->access = 0;
+#else
+    data->heap = NULL;
+    data->stack = NULL;
+    data->stack_length = 0;
+    data->direct_stack = NULL;
+    data->direct_stack_length = 0;
+    data->memory_length = data_pages_length(executable);
+    data->memory = calloc(data->memory_length, 1);
+    data->memory_mapping = NULL;
+    data->memory_mapping_size = 0;
+    memset(data->page_tables, 0, sizeof(data->page_tables));
+    if (data->memory == NULL || 
+        !map_memory(data, data->memory_length, NULL, 0)) {
+        free_memory(data);
+        return false;
+    }
+#endif
+    data->heap_break = HEAP_START;
+    data->heap_committed = 0;
+    memcpy(data->memory, executable->initial_data, memory_size);
+    return true;
+}
+
+/**
+ * Frees the memory of 'data'.
+ */
+static void free_memory(struct runtime_data *data) {
+#ifndef IMPS_GUARD_MEMORY
+    for (int i = 0; i < PAGE_TABLE_LEN; i++) {
+        struct page_table *table = data->page_tables[i];
+        if (table == NULL) {
+            continue;
+        }
+        for (int j = 0; j < PAGE_TABLE_LEN; j++) {
+            uint8_t *page = table->pages[j];
+            if ((page < data->memory || 
+                 page >= data->memory + data->memory_length) &&
+                (page < data->heap || 
+                 page >= data->heap + data->heap_committed) &&
+                (page < data->stack || 
+                 page >= data->stack + data->stack_length)) {
+                free(page);
+            }
+        }
+        free(table);
+    }
+#ifdef IMPS_MMAP
+    if (data->heap != NULL) {
+        munmap(data->heap, HEAP_MAX_SIZE);
+        data->heap = NULL;
+        data->heap_committed = 0;
+    }
+    if (data->stack != NULL) {
+        munmap(data->stack, data->stack_length);
+        data->stack = NULL;
+        data->direct_stack = NULL;
+        data->direct_stack_length = 0;
+    }
+#endif
+#endif
+#ifdef IMPS_MMAP
+    if (data->memory_mapping != NULL) {
+        munmap(data->memory_mapping, data->memory_mapping_size);
+        return;
+    }
+#endif
+    free(data->memory);
+}
+
+/**
+ * Returns the start of the bytes that hold the data segment of 'data', 
+ * storing how many there are in 'length'.
+ */
+static uint8_t *memory_contents(struct runtime_data *data, 
+                                struct imps_file *executable, 
+                                size_t *length) {
+#ifdef IMPS_GUARD_MEMORY
+    (void)executable;
+    *length = GUARD_DATA_SIZE;
+    return data->memory_mapping;
+#else
+    *length = data_pages_length(executable);
+    return data->memory;
+#endif
+}
+
+/**
+ * Saves the memory of 'data' in 'snapshot': the bytes from memory_contents 
+ * followed by every other page that has been written. Returns false if 
+ * there is no memory or file space for it.
+ */
+static bool save_memory(struct runtime_data *data, 
+                        struct imps_file *executable, 
+                        struct imps_snapshot *snapshot) {
+    size_t data_length = 0;
+    uint8_t *contents = memory_contents(data, executable, &data_length);
+    snapshot->pages = NULL;
+    snapshot->num_pages = 0;
+    snapshot->heap_break = data->heap_break;
+#ifndef IMPS_GUARD_MEMORY
+    if (!enter_direct_stack_pages(data)) {
+        return false;
+    }
+    uint32_t data_end = MEMORY_START + (uint32_t)data_length;
+    snapshot->num_pages = list_pages(data, MEMORY_START, data_end, NULL);
+    if (snapshot->num_pages > 0) {
+        snapshot->pages = malloc(snapshot->num_pages * sizeof(uint32_t));
+        if (snapshot->pages == NULL) {
+            return false;
+        }
+        list_pages(data, MEMORY_START, data_end, snapshot->pages);
+    }
+#endif
+    snapshot->memory_length = 
+        data_length + (size_t)snapshot->num_pages * GUEST_PAGE_SIZE;
+#ifdef IMPS_GUARD_MEMORY
+    snapshot->memory_length += data->heap_committed + data->stack_length;
+#endif
+#ifdef IMPS_MMAP
+    snapshot->memory_file = tmpfile();
+    bool saved = snapshot->memory_file != NULL && 
+                 fwrite(contents, 1, data_length, snapshot->memory_file) == 
+                 data_length;
+#ifdef IMPS_GUARD_MEMORY
+    saved = saved && fwrite(data->heap, 1, data->heap_committed, 
+                            snapshot->memory_file) == data->heap_committed &&
+            fwrite(data->stack, 1, data->stack_length, 
+                   snapshot->memory_file) == data->stack_length;
+#else
+    for (uint32_t i = 0; saved && i < snapshot->num_pages; i++) {
+        saved = fwrite(find_page(data, snapshot->pages[i], false), 1, 
+                       GUEST_PAGE_SIZE, snapshot->memory_file) == 
+                GUEST_PAGE_SIZE;
+    }
+#endif
+    if (!saved || fflush(snapshot->memory_file) != 0) {
+        if (snapshot->memory_file != NULL) {
+            fclose(snapshot->memory_file);
+        }
+        free(snapshot->pages);
+        return false;
+    }
+#else
+    snapshot->memory = malloc(snapshot->memory_length);
+    if (snapshot->memory == NULL) {
+        free(snapshot->pages);
+        return false;
+    }
+    memcpy(snapshot->memory, contents, data_length);
+    for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+        memcpy(snapshot->memory + data_length + 
+               (size_t)i * GUEST_PAGE_SIZE, 
+               find_page(data, snapshot->pages[i], false), GUEST_PAGE_SIZE);
+    }
+#endif
+    return true;
+}
+
+/**
+ * Replaces the memory of 'data' with the memory saved in 'snapshot'. With
+ * IMPS_MMAP the saved file is mapped privately, so its pages are shared 
+ * until written to. Returns false if the file can't be mapped or there is
+ * no memory for a copy.
+ */
+static bool restore_memory(struct runtime_data *data, 
+                           struct imps_file *executable,
+                           struct imps_snapshot *snapshot) {
+    data->heap_break = snapshot->heap_break;
+#ifdef IMPS_GUARD_MEMORY
+    (void)executable;
+    int file = fileno(snapshot->memory_file);
+    data->heap_committed = 
+        snapshot->memory_length - GUARD_DATA_SIZE - data->stack_length;
+    return mmap(data->memory_mapping, GUARD_DATA_SIZE, 
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, 
+                file, 0) != MAP_FAILED &&
+           (data->heap_committed == 0 ||
+            mmap(data->heap, data->heap_committed, PROT_READ | PROT_WRITE, 
+                 MAP_PRIVATE | MAP_FIXED, file, 
+                 GUARD_DATA_SIZE) != MAP_FAILED) &&
+           mmap(data->stack, data->stack_length, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_FIXED, file, 
+                GUARD_DATA_SIZE + data->heap_committed) != MAP_FAILED;
+#else
+#ifdef IMPS_MMAP
+    uint8_t *memory = mmap(NULL, snapshot->memory_length, 
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE, 
+                           fileno(snapshot->memory_file), 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+#else
+    uint8_t *memory = malloc(snapshot->memory_length);
+    if (memory == NULL) {
+        return false;
+    }
+    memcpy(memory, snapshot->memory, snapshot->memory_length);
+#endif
+    free_memory(data);
+    data->memory = memory;
+#ifdef IMPS_MMAP
+    data->memory_mapping = memory;
+    data->memory_mapping_size = snapshot->memory_length;
+#endif
+    data->memory_length = snapshot->memory_length;
+    memset(data->page_tables, 0, sizeof(data->page_tables));
+    return map_memory(data, data_pages_length(executable), snapshot->pages, 
+                      snapshot->num_pages);
+#endif
+}
+
+/**
+ * Makes the heap of 'data' accessible up to guest address 'end', committing
+ * its arena HEAP_CHUNK bytes at a time and entering the new pages in the 
+ * page table, except where a fork has already restored a page. The arena is
+ * reserved by the first call that needs it. Without IMPS_MMAP heap pages are
+ * allocated when first written like any other, as they are with sparse 
+ * memory unless IMPS_GUARD_MEMORY is set, when every address is already 
+ * accessible and only the committed length is kept, for snapshots.
+ *
+ * With IMPS_GUARD_MEMORY the arena is only committed up to the host page 
+ * 'end' is in, so an access past that faults and guest_memory only has to
+ * check the break within the pages.
+ */
+static void grow_heap(struct runtime_data *data, uint32_t end) {
+#ifdef IMPS_MMAP
+#ifdef IMPS_GUARD_MEMORY
+    if (end == HEAP_START) {
+        return;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t needed = 
+        (data->memory + (end - MEMORY_START) - data->heap + page_size - 1) &
+        ~(page_size - 1);
+    if (data->heap_committed < needed) {
+        if (!data->sparse && 
+            mprotect(data->heap + data->heap_committed, 
+                     needed - data->heap_committed, 
+                     PROT_READ | PROT_WRITE) != 0) {
+            stop_run(data, IMPS_ERROR, "no memory for the heap");
+        }
+        data->heap_committed = needed;
+    }
+#else
+    if (data->sparse) {
+        return;
+    }
+    size_t needed = end - HEAP_START;
+    if (data->heap == NULL && needed > 0) {
+        uint8_t *heap = mmap(NULL, HEAP_MAX_SIZE, PROT_NONE, 
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                             -1, 0);
+        if (heap == MAP_FAILED) {
+            stop_run(data, IMPS_ERROR, "no memory for the heap");
+        }
+        data->heap = heap;
+    }
+    while (data->heap_committed < needed) {
+        uint8_t *chunk = data->heap + data->heap_committed;
+        if (mprotect(chunk, HEAP_CHUNK, PROT_READ | PROT_WRITE) != 0) {
+            stop_run(data, IMPS_ERROR, "no memory for the heap");
+        }
+        for (size_t offset = 0; offset < HEAP_CHUNK; 
+             offset += GUEST_PAGE_SIZE) {
+            uint8_t **entry = page_entry(data, HEAP_START + 
+                                         data->heap_committed + offset, true);
+            if (*entry == NULL) {
+                *entry = chunk + offset;
+            }
+        }
+        // Loads from these pages may have been reading the zero page.
+        memset(data->read_tlb, 0, sizeof(data->read_tlb));
+        data->heap_committed += HEAP_CHUNK;
+    }
+#endif
+#else
+    (void)data;
+    (void)end;
+#endif
+}
+
+#ifndef IMPS_GUARD_MEMORY
+// Read by every page that has not been written yet.
+static const uint8_t zero_page[GUEST_PAGE_SIZE];
+
+/**
+ * Returns how many bytes back the data segment of 'executable': its initial
+ * data and the padding after it, rounded up to whole pages.
+ */
+static size_t data_pages_length(struct imps_file *executable) {
+    return (executable->memory_size + MEMORY_PADDING + GUEST_PAGE_SIZE - 1) &
+           ~(size_t)(GUEST_PAGE_SIZE - 1);
+}
+
+/**
+ * Enters the memory of 'data' in its empty page table: the first 
+ * 'data_length' bytes as the pages from MEMORY_START, and each page after 
+ * them at the next of the 'num_pages' guest addresses in 'pages'. Empties
+ * the TLBs. Returns false if there is no memory for the page table.
+ */
+static bool map_memory(struct runtime_data *data, size_t data_length, 
+                       uint32_t *pages, uint32_t num_pages) {
+    memset(data->read_tlb, 0, sizeof(data->read_tlb));
+    memset(data->write_tlb, 0, sizeof(data->write_tlb));
+    for (size_t offset = 0; offset < data_length; offset += GUEST_PAGE_SIZE) {
+        if (!map_page(data, MEMORY_START + offset, data->memory + offset)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < num_pages; i++) {
+        if (!map_page(data, pages[i], 
+                      data->memory + data_length + 
+                      (size_t)i * GUEST_PAGE_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Enters 'page' in the page table of 'data' at guest 'address'. Unlike 
+ * page_entry this is used outside a run, so it returns false rather than 
+ * stopping the run if there is no memory for a second level table.
+ */
+static bool map_page(struct runtime_data *data, uint32_t address, 
+                     uint8_t *page) {
+    struct page_table **table = 
+        &data->page_tables[address >> PAGE_TABLE_SHIFT];
+    if (*table == NULL) {
+        *table = calloc(1, sizeof(**table));
+        if (*table == NULL) {
+            return false;
+        }
+    }
+    (*table)->pages[(address >> GUEST_PAGE_SHIFT) & (PAGE_TABLE_LEN - 1)] = 
+        page;
+    return true;
+}
+
+/**
+ * Returns the page table entry for guest 'address', allocating its second
+ * level table if 'create' is set, or NULL if it has none.
+ */
+static uint8_t **page_entry(struct runtime_data *data, uint32_t address, 
+                            bool create) {
+    struct page_table **table = 
+        &data->page_tables[address >> PAGE_TABLE_SHIFT];
+    if (*table == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        *table = calloc(1, sizeof(**table));
+        if (*table == NULL) {
+            stop_run(data, IMPS_ERROR, "no memory for guest page at 0x%08" 
+                     PRIx32, address);
+        }
+    }
+    return &(*table)->pages[(address >> GUEST_PAGE_SHIFT) & 
+                            (PAGE_TABLE_LEN - 1)];
+}
+
+/**
+ * Returns the page holding guest 'address'. A page that has never been 
+ * written is the shared zero page, unless 'write' is set, when it is 
+ * allocated instead.
+ */
+static uint8_t *find_page(struct runtime_data *data, uint32_t address, 
+                          bool write) {
+    uint8_t **entry = page_entry(data, address, write);
+    if (entry == NULL || (*entry == NULL && !write)) {
+        if (address - data->stack_bottom < data->direct_stack_length) {
+            return stack_page(data, address);
+        }
+        return (uint8_t *)zero_page;
+    }
+    if (*entry == NULL) {
+        *entry = stack_page(data, address);
+        if (*entry == NULL) {
+            *entry = calloc(GUEST_PAGE_SIZE, 1);
+        }
+        if (*entry == NULL) {
+            stop_run(data, IMPS_ERROR, "no memory for guest page at 0x%08" 
+                     PRIx32, address);
+        }
+        // Loads from this page were reading the zero page.
+        struct tlb_entry *cached = 
+            &data->read_tlb[(address >> GUEST_PAGE_SHIFT) & (TLB_LEN - 1)];
+        if (cached->page == zero_page) {
+            memset(cached, 0, sizeof(*cached));
+        }
+    }
+    return *entry;
+}
+
+/**
+ * Returns the page of the stack mapping of 'data' that backs guest 
+ * 'address', mapping the whole stack first if this is its first page. 
+ * Returns NULL if 'address' is not on the stack or the stack can't be 
+ * mapped, and always without IMPS_MMAP, when stack pages are allocated one
+ * at a time like any other.
+ */
+static uint8_t *stack_page(struct runtime_data *data, uint32_t address) {
+#ifdef IMPS_MMAP
+    if (address < data->stack_bottom || address >= STACK_TOP) {
+        return NULL;
+    }
+    if (data->stack == NULL) {
+        size_t length = STACK_TOP - data->stack_bottom;
+        uint8_t *stack = mmap(NULL, length, PROT_READ | PROT_WRITE, 
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+        if (stack == MAP_FAILED) {
+            return NULL;
+        }
+        data->stack = stack;
+        data->stack_length = length;
+        // Compiled code can use the mapping directly unless a fork has 
+        // restored stack pages elsewhere. Loads of stack pages that have no
+        // entry then read the mapping rather than the zero page, since 
+        // compiled code may have written them.
+        if (!stack_pages_entered(data)) {
+            data->direct_stack = stack;
+            data->direct_stack_length = length;
+            memset(data->read_tlb, 0, sizeof(data->read_tlb));
+        }
+    }
+    return data->stack + ((address - data->stack_bottom) & 
+                          ~(uint32_t)(GUEST_PAGE_SIZE - 1));
+#else
+    (void)data;
+    (void)address;
+    return NULL;
+#endif
+}
+
+/**
+ * Stores the guest address of every page of 'data' that has been written 
+ * and is not from 'start' up to 'end' in 'pages', unless it is NULL. 
+ * Returns how many there are.
+ */
+static uint32_t list_pages(struct runtime_data *data, uint32_t start, 
+                           uint32_t end, uint32_t *pages) {
+    uint32_t num_pages = 0;
+    for (uint32_t i = 0; i < PAGE_TABLE_LEN; i++) {
+        struct page_table *table = data->page_tables[i];
+        for (uint32_t j = 0; table != NULL && j < PAGE_TABLE_LEN; j++) {
+            uint32_t address = i << PAGE_TABLE_SHIFT | j << GUEST_PAGE_SHIFT;
+            if (table->pages[j] != NULL && 
+                (address < start || address >= end)) {
+                if (pages != NULL) {
+                    pages[num_pages] = address;
+                }
+                num_pages++;
+            }
+        }
+    }
+    return num_pages;
+}
+
+#ifdef IMPS_MMAP
+/**
+ * Returns whether any page of the stack of 'data' has a page table entry.
+ */
+static bool stack_pages_entered(struct runtime_data *data) {
+    for (uint32_t address = data->stack_bottom; address < STACK_TOP; 
+         address += GUEST_PAGE_SIZE) {
+        uint8_t **entry = page_entry(data, address, false);
+        if (entry != NULL && *entry != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/**
+ * Enters every page of the stack mapping of 'data' that compiled code has 
+ * written without it being entered in the page table, so that list_pages 
+ * finds it. Pages that are still all zero are left out. Returns false if 
+ * there is no memory for the page table.
+ */
+static bool enter_direct_stack_pages(struct runtime_data *data) {
+    for (uint32_t offset = 0; offset < data->direct_stack_length; 
+         offset += GUEST_PAGE_SIZE) {
+        uint32_t address = data->stack_bottom + offset;
+        uint8_t **entry = page_entry(data, address, false);
+        uint8_t *page = data->direct_stack + offset;
+        bool written = page[0] != 0 || 
+                       memcmp(page, page + 1, GUEST_PAGE_SIZE - 1) != 0;
+        if ((entry == NULL || *entry == NULL) && written && 
+            !map_page(data, address, page)) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef IMPS_GUARD_MEMORY
+// The run on this thread whose memory faults are reported for.
+static _Thread_local struct runtime_data *guarded_run = NULL;
+
+// What SIGSEGV did before, for faults that are not in guest memory.
+static struct sigaction previous_segv_action;
+static struct sigaction previous_bus_action;
+static pthread_once_t guard_handler_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Installs guard_handler for SIGSEGV and SIGBUS, once per process. The 
+ * handler runs without blocking further faults since it leaves by longjmp.
+ */
+static void install_guard_handler(void) {
+    pthread_once(&guard_handler_once, install_guard_actions);
+}
+
+/**
+ * Called once by install_guard_handler.
+ */
+static void install_guard_actions(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv_action);
+    sigaction(SIGBUS, &action, &previous_bus_action);
+}
+
+/**
+ * Stops the run on this thread with the bad address error of the access in 
+ * progress if the fault is in its memory. Any other fault is passed to the 
+ * previous handler, which stays behind this one. Only the default or 
+ * ignore action is put back, and the signal raised again under it.
+ */
+static void guard_handler(int signal, siginfo_t *info, void *context) {
+    struct runtime_data *data = guarded_run;
+    uint8_t *address = info->si_addr;
+    if (data != NULL && data->escape != NULL && 
+        address >= data->memory_mapping && 
+        address < data->memory_mapping + data->memory_mapping_size) {
+        bad_address(data, (uint32_t)data->access, data->access >> 32);
+    }
+    struct sigaction *previous = signal == SIGSEGV ? &previous_segv_action :
+                                                     &previous_bus_action;
+    if (previous->sa_flags & SA_SIGINFO) {
+        previous->sa_sigaction(signal, info, context);
+    } else if (previous->sa_handler != SIG_DFL && 
+               previous->sa_handler != SIG_IGN) {
+        previous->sa_handler(signal);
+    } else {
+        sigaction(signal, previous, NULL);
+        raise(signal);
+    }
+}
+#endif
+
+/**
+ * Stops the run with 'status' by jumping back to where it was started. For
+ * errors 'message' is filled in from 'format', like printf.
+ */
+_Noreturn static void stop_run(struct runtime_data *data, int status, 
+                               const char *format, ...) {
+    if (format != NULL) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(data->message, IMPS_MESSAGE_LEN, format, args);
+        va_end(args);
+    }
+    longjmp(*data->escape, status);
+}
+
+/**
+ * Writes guest output to stdout.
+ */
+static void stdio_write(void *context, const char *bytes, size_t length) {
+    (void)context;
+    fwrite(bytes, 1, length, stdout);
+}
+
+/**
+ * Reads guest input from stdin.
+ */
+static int stdio_read(void *context) {
+    (void)context;
+    return getchar();
+}
+
+#ifndef IMPS_LIBRARY
+/**
+ * Adds guest output to the output_buffer 'context', writing the buffer out
+ * first if there is no room for it. Output at least as large as the buffer
+ * is written straight away.
+ */
+static void buffered_write(void *context, const char *bytes, size_t length) {
+    struct output_buffer *output = context;
+    if (length > OUTPUT_BUFFER_LEN - output->length) {
+        flush_output(output);
+    }
+    if (length >= OUTPUT_BUFFER_LEN) {
+        write_stdout(bytes, length);
+    } else {
+        memcpy(output->bytes + output->length, bytes, length);
+        output->length += length;
+    }
+}
+
+/**
+ * Reads guest input from stdin once the output_buffer 'context' has been 
+ * written out, so a prompt is seen before the program waits for an answer.
+ */
+static int buffered_read(void *context) {
+    flush_output(context);
+    return getchar();
+}
+
+/**
+ * Writes out and empties 'output'.
+ */
+static void flush_output(struct output_buffer *output) {
+    write_stdout(output->bytes, output->length);
+    output->length = 0;
+}
+
+/**
+ * Writes 'length' bytes to stdout, with write(2) on unix hosts. Output that
+ * can't be written is dropped, as stdio would.
+ */
+static void write_stdout(const char *bytes, size_t length) {
+#ifdef IMPS_WRITE
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        bytes += written;
+        length -= written;
+    }
+#else
+    fwrite(bytes, 1, length, stdout);
+    fflush(stdout);
+#endif
+}
+#endif
+
+/**
+ * Formats 'value' in decimal into the characters before 'end', which needs
+ * INT32_DECIMAL_LEN of them, and returns where it starts. Digits are made
+ * two at a time from a table, with no division by anything but 100.
+ */
+static char *format_int32(char *end, int32_t value) {
+    static const char digit_pairs[] = 
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+    uint32_t magnitude = value < 0 ? 0 - (uint32_t)value : (uint32_t)value;
+    char *start = end;
+    while (magnitude >= 100) {
+        start -= 2;
+        memcpy(start, digit_pairs + magnitude % 100 * 2, 2);
+        magnitude /= 100;
+    }
+    if (magnitude >= 10) {
+        start -= 2;
+        memcpy(start, digit_pairs + magnitude * 2, 2);
+    } else {
+        *--start = '0' + magnitude;
+    }
+    if (value < 0) {
+        *--start = '-';
+    }
+    return start;
+}
+
+// Library interface, see imps.h.
+
+struct imps_vm *imps_vm_create(void) {
+    struct imps_vm *vm = calloc(1, sizeof(*vm));
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm->options.threaded_after = TIER_THREADED_AFTER;
+    vm->options.jit_after = TIER_JIT_AFTER;
+    vm->options.sparse_memory = false;
+    vm->options.stack_size = STACK_DEFAULT_SIZE;
+    vm->write = stdio_write;
+    vm->read = stdio_read;
+    vm->status = IMPS_INVALID;
+    snprintf(vm->message, IMPS_MESSAGE_LEN, "no program loaded");
+    return vm;
+}
+
+int imps_vm_load_buffer(struct imps_vm *vm, const void *buffer, 
+                        size_t length) {
+    unload_program(vm);
+    vm->status = IMPS_NO_MEMORY;
+    snprintf(vm->message, IMPS_MESSAGE_LEN, "out of memory");
+    struct imps_program *program = calloc(1, sizeof(*program));
+    if (program == NULL) {
+        return vm->status;
+    }
+    atomic_init(&program->references, 1);
+    vm->program = program;
+    program->image = malloc(length > 0 ? length : 1);
+    if (program->image == NULL) {
+        return vm->status;
+    }
+    memcpy(program->image, buffer, length);
+    if (!parse_executable(program->image, length, false, 
+                          &program->executable, vm->message, 
+                          IMPS_MESSAGE_LEN)) {
+        unload_program(vm);
+        vm->status = IMPS_INVALID;
+        return vm->status;
+    }
+    program->code = predecode(&program->executable);
+    if (program->code == NULL) {
+        unload_program(vm);
+        return vm->status;
+    }
+    vm->data = create_data(program->code, &program->executable, 
+                           &vm->options);
+    vm->files = malloc(MAX_FILE_NUM * sizeof(*vm->files));
+    vm->descriptors = malloc(MAX_DESC_NUM * sizeof(*vm->descriptors));
+    if (vm->data == NULL || vm->files == NULL || vm->descriptors == NULL) {
+        free(vm->files);
+        free(vm->descriptors);
+        vm->files = NULL;
+        vm->descriptors = NULL;
+        unload_program(vm);
+        snprintf(vm->message, IMPS_MESSAGE_LEN, 
+                 "could not reserve guest memory");
+        return vm->status;
+    }
+    vm->data->write = vm->write;
+    vm->data->read = vm->read;
+    vm->data->io_context = vm->io_context;
+    vm->data->chain = false;
+    initialise_files(vm->files, vm->descriptors);
+    vm->status = IMPS_OK;
+    vm->message[0] = '\0';
+    return vm->status;
+}
+
+void imps_vm_set_io(struct imps_vm *vm, imps_write_fn write, 
+                    imps_read_fn read, void *context) {
+    vm->write = write;
+    vm->read = read;
+    vm->io_context = context;
+    if (vm->data != NULL) {
+        vm->data->write = write;
+        vm->data->read = read;
+        vm->data->io_context = context;
+    }
+}
+
+int imps_vm_run(struct imps_vm *vm, uint64_t budget) {
+    // A run that ran out of memory stopped where it could go on from.
+    if (vm->status != IMPS_OK && vm->status != IMPS_RUNNING &&
+        (vm->status != IMPS_NO_MEMORY || vm->data == NULL)) {
+        return vm->status;
+    }
+    jmp_buf escape;
+    vm->data->escape = &escape;
+    int status = setjmp(escape);
+    if (status == 0) {
+        run_blocks(vm->data, &vm->program->executable, vm->files, 
+                   vm->descriptors, 
+                   &vm->options, budget);
+        status = IMPS_RUNNING;
+    } else if (status == IMPS_ERROR || status == IMPS_NO_MEMORY) {
+        memcpy(vm->message, vm->data->message, IMPS_MESSAGE_LEN);
+    }
+    vm->data->escape = NULL;
+    vm->status = status;
+    return vm->status;
+}
+
+const char *imps_vm_message(struct imps_vm *vm) {
+    return vm->message;
+}
+
+void imps_vm_destroy(struct imps_vm *vm) {
+    if (vm == NULL) {
+        return;
+    }
+    unload_program(vm);
+    free(vm);
+}
+
+struct imps_snapshot *imps_vm_snapshot(struct imps_vm *vm) {
+    if (vm->status != IMPS_OK && vm->status != IMPS_RUNNING) {
+        return NULL;
+    }
+    struct imps_snapshot *snapshot = malloc(sizeof(*snapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    if (!save_memory(vm->data, &vm->program->executable, snapshot)) {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->program = vm->program;
+    atomic_fetch_add(&snapshot->program->references, 1);
+    memcpy(snapshot->registers, vm->data->registers, 
+           sizeof(snapshot->registers));
+    snapshot->index = vm->data->index;
+    copy_files(snapshot->files, vm->files);
+    memcpy(snapshot->descriptors, vm->descriptors, 
+           sizeof(snapshot->descriptors));
+    snapshot->options = vm->options;
+    snapshot->write = vm->write;
+    snapshot->read = vm->read;
+    snapshot->io_context = vm->io_context;
+    return snapshot;
+}
+
+struct imps_vm *imps_vm_fork(struct imps_snapshot *snapshot) {
+    struct imps_vm *vm = imps_vm_create();
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm->program = snapshot->program;
+    atomic_fetch_add(&vm->program->references, 1);
+    vm->options = snapshot->options;
+    vm->write = snapshot->write;
+    vm->read = snapshot->read;
+    vm->io_context = snapshot->io_context;
+    vm->data = create_data(vm->program->code, &vm->program->executable,
+                           &vm->options);
+    vm->files = malloc(MAX_FILE_NUM * sizeof(*vm->files));
+    vm->descriptors = malloc(MAX_DESC_NUM * sizeof(*vm->descriptors));
+    if (vm->data == NULL || vm->files == NULL || vm->descriptors == NULL) {
+        free(vm->files);
+        free(vm->descriptors);
+        vm->files = NULL;
+        vm->descriptors = NULL;
+        imps_vm_destroy(vm);
+        return NULL;
+    }
+    copy_files(vm->files, snapshot->files);
+    memcpy(vm->descriptors, snapshot->descriptors, 
+           sizeof(snapshot->descriptors));
+    if (!restore_memory(vm->data, &vm->program->executable, snapshot)) {
+        imps_vm_destroy(vm);
+        return NULL;
+    }
+    memcpy(vm->data->registers, snapshot->registers, 
+           sizeof(snapshot->registers));
+    vm->data->index = snapshot->index;
+    vm->data->write = vm->write;
+    vm->data->read = vm->read;
+    vm->data->io_context = vm->io_context;
+    vm->data->chain = false;
+    vm->status = IMPS_OK;
+    vm->message[0] = '\0';
+    return vm;
+}
+
+void imps_snapshot_destroy(struct imps_snapshot *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+#ifdef IMPS_MMAP
+    fclose(snapshot->memory_file);
+#else
+    free(snapshot->memory);
+#endif
+    free(snapshot->pages);
+    for (int i = 0; i < MAX_FILE_NUM; i++) {
+        free(snapshot->files[i].path);
+    }
+    release_program(snapshot->program);
+    free(snapshot);
+}
+
+/**
+ * Frees the program loaded into 'vm', if any, and everything it was running
+ * with.
+ */
+static void unload_program(struct imps_vm *vm) {
+    if (vm->data != NULL) {
+        free_data(vm->data, vm->files, vm->descriptors);
+    }
+    if (vm->program != NULL) {
+        release_program(vm->program);
+    }
+    vm->data = NULL;
+    vm->files = NULL;
+    vm->descriptors = NULL;
+    vm->program = NULL;
+}
+
+/**
+ * Drops one reference to 'program', freeing it once the last instance or 
+ * snapshot using it is gone.
+ */
+static void release_program(struct imps_program *program) {
+    if (atomic_fetch_sub(&program->references, 1) == 1) {
+        free(program->code);
+        free(program->image);
+        free(program);
+    }
+}
+
+/**
+ * Copies the emulated files 'from' into 'to', including their paths.
+ */
+static void copy_files(struct file *to, struct file *from) {
+    for (int i = 0; i < MAX_FILE_NUM; i++) {
+        to[i] = from[i];
+        if (from[i].path != NULL) {
+            to[i].path = strdup(from[i].path);
+        }
+    }
+}
+
+#ifdef IMPS_BATCH
+/**
+ * Runs every job in the manifest at 'manifest_path' on 'num_workers' 
+ * threads and writes their output, and any errors, in manifest order. 
+ * Returns the exit status of the emulator: failure if any job failed.
+ */
+static int run_batch(char *manifest_path, uint32_t num_workers, 
+                     char *cache_dir, struct run_options *options) {
+    struct batch batch = {0};
+    batch.options = options;
+    read_manifest(manifest_path, &batch);
+    load_batch_programs(&batch, cache_dir);
+
+    // Each worker starts with an even share of the jobs, in order.
+    if (num_workers > batch.num_jobs && batch.num_jobs > 0) {
+        num_workers = batch.num_jobs;
+    }
+    batch.num_workers = num_workers;
+    batch.queues = malloc(num_workers * sizeof(*batch.queues));
+    pthread_t *threads = malloc(num_workers * sizeof(*threads));
+    struct batch_worker *workers = malloc(num_workers * sizeof(*workers));
+    if (batch.queues == NULL || threads == NULL || workers == NULL) {
+        batch_memory_error();
+    }
+    for (uint32_t i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].head = (uint64_t)batch.num_jobs * i / num_workers;
+        batch.queues[i].tail = 
+            (uint64_t)batch.num_jobs * (i + 1) / num_workers;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+    for (uint32_t i = 0; i < num_workers; i++) {
+        workers[i].batch = &batch;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, batch_worker, 
+                           &workers[i]) != 0) {
+            fprintf(stderr, "IMPS error: could not start batch workers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Write out each job as soon as it and every job before it are done.
+    int exit_status = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < batch.num_jobs; i++) {
+        struct batch_job *job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done) {
+            pthread_cond_wait(&batch.finished, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        if (job->output.length > 0) {
+            fwrite(job->output.bytes, 1, job->output.length, stdout);
+        }
+        if (job->status != IMPS_EXITED) {
+            fflush(stdout);
+            if (job->status == IMPS_ERROR || 
+                job->status == IMPS_NO_MEMORY) {
+                fprintf(stderr, "IMPS error: %s\n", job->message);
+            } else {
+                fprintf(stderr, "%s\n", job->message);
+            }
+            exit_status = EXIT_FAILURE;
+        }
+        free(job->output.bytes);
+    }
+    fflush(stdout);
+
+    // A worker can still be stealing from any queue until it has returned.
+    for (uint32_t i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (uint32_t i = 0; i < num_workers; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.finished);
+    free(threads);
+    free(workers);
+    free(batch.queues);
+    for (uint32_t i = 0; i < batch.num_programs; i++) {
+        if (batch.programs[i].bytes != NULL) {
+            free(batch.programs[i].image.code);
+            free(batch.programs[i].bytes);
+        } else if (batch.programs[i].loaded) {
+            free_imps_file(&batch.programs[i].executable, 
+                           &batch.programs[i].image);
+        }
+    }
+    free(batch.programs);
+    for (uint32_t i = 0; i < batch.num_jobs; i++) {
+        free(batch.jobs[i].path);
+        free(batch.jobs[i].input_path);
+    }
+    free(batch.jobs);
+    return exit_status;
+}
+
+/**
+ * Reads the jobs of 'batch' from the manifest at 'manifest_path'. Each line
+ * names an executable, optionally followed by a file to use as its input. 
+ * Blank lines and lines starting with '#' are skipped. Exits if the manifest
+ * can't be read, a line has anything else on it or there is no memory for
+ * the jobs.
+ */
+static void read_manifest(char *manifest_path, struct batch *batch) {
+    FILE *stream = fopen(manifest_path, "r");
+    if (stream == NULL) {
+        perror(manifest_path);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t capacity = 0;
+    uint32_t line_number = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, stream) != -1) {
+        line_number++;
+        char *saved;
+        char *path = strtok_r(line, " \t\r\n", &saved);
+        if (path == NULL || path[0] == '#') {
+            continue;
+        }
+        char *input_path = strtok_r(NULL, " \t\r\n", &saved);
+        if (input_path != NULL && strtok_r(NULL, " \t\r\n", &saved) != NULL) {
+            fprintf(stderr, "Invalid batch manifest: line %" PRIu32 
+                    " has more than an executable and an input file\n", 
+                    line_number);
+            exit(EXIT_FAILURE);
+        }
+        if (batch->num_jobs == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct batch_job *jobs = 
+                realloc(batch->jobs, capacity * sizeof(*batch->jobs));
+            if (jobs == NULL) {
+                batch_memory_error();
+            }
+            batch->jobs = jobs;
+        }
+        struct batch_job *job = &batch->jobs[batch->num_jobs];
+        memset(job, 0, sizeof(*job));
+        job->path = strdup(path);
+        if (input_path != NULL) {
+            job->input_path = strdup(input_path);
+        }
+        if (job->path == NULL || 
+            (input_path != NULL && job->input_path == NULL)) {
+            batch_memory_error();
+        }
+        batch->num_jobs++;
+    }
+    free(line);
+    fclose(stream);
+}
+
+/**
+ * Loads every executable named by the jobs of 'batch' once, however many 
+ * jobs run it, and points the jobs at them. An executable that can't be 
+ * loaded only fails the jobs that run it.
+ */
+static void load_batch_programs(struct batch *batch, char *cache_dir) {
+    // Sorting the jobs by path brings the jobs of each program together.
+    struct batch_job **sorted = malloc(batch->num_jobs * sizeof(*sorted));
+    batch->programs = malloc(batch->num_jobs * sizeof(*batch->programs));
+    if (batch->num_jobs > 0 && (sorted == NULL || batch->programs == NULL)) {
+        batch_memory_error();
+    }
+    for (uint32_t i = 0; i < batch->num_jobs; i++) {
+        sorted[i] = &batch->jobs[i];
+    }
+    qsort(sorted, batch->num_jobs, sizeof(*sorted), compare_job_paths);
+    struct batch_program *program = NULL;
+    for (uint32_t i = 0; i < batch->num_jobs; i++) {
+        if (program == NULL || strcmp(program->path, sorted[i]->path) != 0) {
+            program = &batch->programs[batch->num_programs];
+            batch->num_programs++;
+            memset(program, 0, sizeof(*program));
+            program->path = sorted[i]->path;
+            program->loaded = load_batch_program(program, cache_dir);
+        }
+        sorted[i]->program = program;
+    }
+    free(sorted);
+}
+
+/**
+ * Exits with an error when there is no memory to set up a batch.
+ */
+_Noreturn static void batch_memory_error(void) {
+    fprintf(stderr, "IMPS error: no memory for the batch\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Loads the executable of 'program' and its predecoded instructions from one
+ * read of the file, like load_imps_file but without exiting. If 'cache_dir'
+ * is given, both are mapped from the translation cache when it holds the 
+ * bytes read, and stored there otherwise. Returns false with the error a 
+ * single run would print in the program's message if the executable can't 
+ * be loaded.
+ */
+static bool load_batch_program(struct batch_program *program, 
+                               char *cache_dir) {
+    size_t length;
+    char *bytes = read_whole_file(program->path, &length);
+    if (bytes == NULL) {
+        snprintf(program->message, IMPS_MESSAGE_LEN, "%s: %s", 
+                 program->path, strerror(errno));
+        return false;
+    }
+#ifdef IMPS_CACHE
+    char *cache_path = NULL;
+    uint64_t key = 0;
+    if (cache_dir != NULL) {
+        cache_path = cache_key_path((uint8_t *)bytes, length, cache_dir, 
+                                    &key);
+    }
+    if (cache_path != NULL && 
+        map_cache_file(cache_path, key, &program->executable, 
+                       &program->image)) {
+        free(cache_path);
+        free(bytes);
+        return true;
+    }
+    // The cache stores the debug offsets too.
+    bool debug = cache_path != NULL;
+#else
+    (void)cache_dir;
+    bool debug = false;
+#endif
+    // The reason follows the prefix, except for a bad magic number, which 
+    // is reported without one, as by check_magic_number.
+    int prefix = snprintf(program->message, IMPS_MESSAGE_LEN, 
+                          "Invalid IMPS file: ");
+    bool magic = length >= MAGIC_NUM_SIZE && bytes[0] == MAGIC_BYTE_0 && 
+                 bytes[1] == MAGIC_BYTE_1 && bytes[2] == MAGIC_BYTE_2 && 
+                 bytes[3] == MAGIC_BYTE_3;
+    bool valid = parse_executable((uint8_t *)bytes, length, debug, 
+                                  &program->executable, 
+                                  program->message + prefix, 
+                                  IMPS_MESSAGE_LEN - prefix);
+    if (!magic) {
+        snprintf(program->message, IMPS_MESSAGE_LEN, "Invalid IMPS file");
+    }
+    if (valid) {
+        program->image.code = predecode(&program->executable);
+        if (program->image.code == NULL) {
+            snprintf(program->message, IMPS_MESSAGE_LEN, 
+                     "IMPS error: could not reserve guest memory");
+            valid = false;
+        }
+    }
+#ifdef IMPS_CACHE
+    if (valid && cache_path != NULL) {
+        write_cache_file(cache_path, key, &program->executable, 
+                         program->image.code);
+    }
+    free(cache_path);
+#endif
+    if (!valid) {
+        free(bytes);
+        return false;
+    }
+    program->bytes = bytes;
+    return true;
+}
+
+/**
+ * Orders jobs by the path of their executable, for qsort.
+ */
+static int compare_job_paths(const void *first, const void *second) {
+    const struct batch_job *job1 = *(struct batch_job *const *)first;
+    const struct batch_job *job2 = *(struct batch_job *const *)second;
+    return strcmp(job1->path, job2->path);
+}
+
+/**
+ * Runs the jobs of a batch until there are none left to start, its own 
+ * first and then any it can steal.
+ */
+static void *batch_worker(void *arg) {
+    struct batch_worker *worker = arg;
+    struct batch *batch = worker->batch;
+    uint32_t index;
+    while (take_batch_job(batch, worker->id, &index)) {
+        struct batch_job *job = &batch->jobs[index];
+        run_batch_job(job, batch->options);
+        pthread_mutex_lock(&batch->lock);
+        job->done = true;
+        pthread_cond_broadcast(&batch->finished);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Takes the next job of worker 'id' from the head of its queue or, once 
+ * that is empty, the last job of another worker's queue. Returns false if 
+ * every queue is empty. Jobs are never added, so a worker that finds 
+ * nothing is done.
+ */
+static bool take_batch_job(struct batch *batch, uint32_t id, uint32_t *job) {
+    struct batch_queue *queue = &batch->queues[id];
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) {
+        *job = queue->head;
+        queue->head++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    for (uint32_t i = 1; !found && i < batch->num_workers; i++) {
+        struct batch_queue *victim = 
+            &batch->queues[(id + i) % batch->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        found = victim->head < victim->tail;
+        if (found) {
+            victim->tail--;
+            *job = victim->tail;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return found;
+}
+
+/**
+ * Runs one job to completion with its own registers, memory, files and 
+ * descriptors, capturing its output and how it ended.
+ */
+static void run_batch_job(struct batch_job *job, struct run_options *options) {
+    job->status = IMPS_EXITED;
+    if (!job->program->loaded) {
+        job->status = IMPS_INVALID;
+        memcpy(job->message, job->program->message, IMPS_MESSAGE_LEN);
+        return;
+    }
+    if (job->input_path != NULL) {
+        job->input = read_whole_file(job->input_path, &job->input_length);
+        if (job->input == NULL) {
+            job->status = IMPS_INVALID;
+            snprintf(job->message, IMPS_MESSAGE_LEN, "%s: %s", 
+                     job->input_path, strerror(errno));
+            return;
+        }
+    }
+
+    struct imps_file *executable = &job->program->executable;
+    struct runtime_data *data = 
+        create_data(job->program->image.code, executable, options);
+    struct file *files = malloc(MAX_FILE_NUM * sizeof(*files));
+    struct descriptor *descriptors = 
+        malloc(MAX_DESC_NUM * sizeof(*descriptors));
+    if (data == NULL || files == NULL || descriptors == NULL) {
+        if (data != NULL) {
+            free_data(data, NULL, NULL);
+        }
+        free(files);
+        free(descriptors);
+        job->status = IMPS_ERROR;
+        snprintf(job->message, IMPS_MESSAGE_LEN, 
+                 "could not reserve guest memory");
+        free(job->input);
+        job->input = NULL;
+        return;
+    }
+    data->write = batch_write;
+    data->read = batch_read;
+    data->io_context = job;
+    job->data = data;
+    initialise_files(files, descriptors);
+
+    jmp_buf escape;
+    data->escape = &escape;
+    int status = setjmp(escape);
+    if (status == 0) {
+        run_blocks(data, executable, files, descriptors, options, 0);
+    }
+    job->status = status;
+    if (status == IMPS_ERROR || status == IMPS_NO_MEMORY) {
+        memcpy(job->message, data->message, IMPS_MESSAGE_LEN);
+    }
+    job->data = NULL;
+    free_data(data, files, descriptors);
+    free(job->input);
+    job->input = NULL;
+}
+
+/**
+ * Appends a job's output to its buffer. A job that prints more than 
+ * BATCH_OUTPUT_MAX bytes, or more than there is memory for, is stopped with
+ * an error rather than taking the other jobs down with it.
+ */
+static void batch_write(void *context, const char *bytes, size_t length) {
+    struct batch_job *job = context;
+    struct batch_output *output = &job->output;
+    if (length > BATCH_OUTPUT_MAX - output->length) {
+        stop_run(job->data, IMPS_ERROR, 
+                 "output is over the batch limit of %d MiB", 
+                 BATCH_OUTPUT_MAX / (1024 * 1024));
+    }
+    if (output->length + length > output->capacity) {
+        size_t capacity = output->capacity == 0 ? 
+                          BATCH_OUTPUT_LEN : output->capacity * 2;
+        while (capacity < output->length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(output->bytes, capacity);
+        if (grown == NULL) {
+            stop_run(job->data, IMPS_ERROR, "no memory for batch output");
+        }
+        output->bytes = grown;
+        output->capacity = capacity;
+    }
+    memcpy(output->bytes + output->length, bytes, length);
+    output->length += length;
+}
+
+/**
+ * Reads the next character of a job's input file, EOF after the last one or
+ * if it has none.
+ */
+static int batch_read(void *context) {
+    struct batch_job *job = context;
+    if (job->input_position >= job->input_length) {
+        return EOF;
+    }
+    return (uint8_t)job->input[job->input_position++];
+}
+
+/**
+ * Returns the contents of the file at 'path', storing its size in 'length',
+ * or NULL with errno set if it can't be read.
+ */
+static char *read_whole_file(char *path, size_t *length) {
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+    size_t capacity = BATCH_OUTPUT_LEN;
+    char *bytes = malloc(capacity);
+    *length = 0;
+    size_t count;
+    while (bytes != NULL &&
+           (count = fread(bytes + *length, 1, capacity - *length, 
+                          stream)) > 0) {
+        *length += count;
+        if (*length == capacity) {
+            capacity *= 2;
+            char *grown = realloc(bytes, capacity);
+            if (grown == NULL) {
+                free(bytes);
+            }
+            bytes = grown;
+        }
+    }
+    fclose(stream);
+    if (bytes == NULL) {
+        errno = ENOMEM;
+    }
+    return bytes;
+}
+#endif
+
+#ifndef IMPS_LIBRARY
+/**
+ * Portable execution loop, dispatching each predecoded instruction through a
+ * switch on its handler id.
+ */
+static void run_switch(struct runtime_data *data, struct imps_file *executable,
+                       struct file *files, struct descriptor *descriptors,
+                       int trace_mode, char *path) {
+#ifdef IMPS_GUARD_MEMORY
+    guarded_run = data;
+#endif
+    while (1) {
+        if (data->index >= executable->num_instructions) {
+            print_past_end(data);
+        }
+        // If trace mode is on, make a copy of the registers.
+        if (trace_mode == 1) {
+            trace(data, executable, path);
+            memcpy(data->prev_registers, data->registers, 
+                NUM_REGISTERS * sizeof(uint32_t));
+        } else if (trace_mode == PROFILE_MODE) {
+            active_profile->counts[data->index]++;
+        }
+        execute_inst(&data->code[data->index], data, executable, files, 
+                     descriptors);
+        if (trace_mode == 1) {
+            print_modified(data);
+        }
+    }
+}
+#endif
+
+/**
+ * Block level execution loop. Instructions are run a basic block at a time
+ * and each block remembers the blocks it exits to, so a loop keeps going from
+ * block to block without looking anything up. The verifier has sent every 
+ * way of running past the end to the sentinel instruction, so nothing here 
+ * checks the index.
+ *
+ * Blocks are tiered by how often they run, so code that only runs a few
+ * times never pays for more than it needs. A block starts out interpreted
+ * with the switch, is fused into superinstructions and threaded once it has
+ * run 'threaded_after' times, and is compiled by the JIT once it has run 
+ * 'jit_after' times. The JIT itself is only set up when the first block 
+ * gets that far, so runs that never get hot don't pay for it.
+ *
+ * With IMPS_THREADED the instructions of a threaded block are direct 
+ * threaded: each instruction is given the address of its handler label when
+ * the block is promoted and every handler ends in its own dispatch to the 
+ * next one. Without it threaded blocks still run their superinstructions, 
+ * through the switch.
+ *
+ * A 'budget' other than 0 makes the loop return once about that many 
+ * instructions have run, counted a block at a time. The state of the loop
+ * is kept in 'data', so calling it again goes on from there.
+ */
+static void run_blocks(struct runtime_data *data, 
+                       struct imps_file *executable, struct file *files,
+                       struct descriptor *descriptors, 
+                       struct run_options *options, uint64_t budget) {
+    uint32_t num_instructions = executable->num_instructions;
+    if (data->blocks == NULL) {
+        struct block **blocks = 
+            calloc(num_instructions + 1, sizeof(*data->blocks));
+        // Blocks are fused into this copy of the code when they are 
+        // promoted.
+        data->fused = malloc((num_instructions + 1) * sizeof(*data->fused));
+#ifdef IMPS_THREADED
+        // Filled in for each block as it is promoted.
+        data->threaded = 
+            malloc((num_instructions + 1) * sizeof(*data->threaded));
+        bool threaded_failed = data->threaded == NULL;
+#else
+        bool threaded_failed = false;
+#endif
+        if (blocks == NULL || data->fused == NULL || threaded_failed) {
+            // Leave 'blocks' empty so that the next run tries again.
+            free(blocks);
+            free(data->fused);
+            data->fused = NULL;
+#ifdef IMPS_THREADED
+            free(data->threaded);
+            data->threaded = NULL;
+#endif
+            stop_run(data, IMPS_NO_MEMORY, "no memory for the block cache");
+        }
+        data->blocks = blocks;
+        memcpy(data->fused, data->code, 
+               (num_instructions + 1) * sizeof(*data->fused));
+    }
+    struct block **blocks = data->blocks;
+    struct block *block = NULL;
+    struct decoded_inst *fused = data->fused;
+#ifdef IMPS_GUARD_MEMORY
+    guarded_run = data;
+#endif
+    uint64_t limit = budget == 0 ? UINT64_MAX : budget;
+    uint64_t executed = 0;
+    // Executions needed to leave each tier below 'last_tier', the last one
+    // blocks are promoted to by counting.
+    uint32_t promote_after[TIER_COMPILING] = {
+        options->threaded_after, options->jit_after
+    };
+    uint8_t last_tier = TIER_THREADED;
+#ifdef IMPS_JIT
+    struct jit *jit = data->jit;
+    if (!data->jit_failed) {
+        last_tier = TIER_COMPILING;
+    }
+#endif
+#ifdef IMPS_THREADED
+    static void *const handler_labels[] = {
+        [HANDLER_BAD] = &&bad,
+        [HANDLER_ADDI] = &&addi,
+        [HANDLER_ORI] = &&ori,
+        [HANDLER_LUI] = &&lui,
+        [HANDLER_ADDIU] = &&addiu,
+        [HANDLER_MUL] = &&mul,
+        [HANDLER_BEQ] = &&beq,
+        [HANDLER_BNE] = &&bne,
+        [HANDLER_SYSCALL] = &&syscall,
+        [HANDLER_ADD] = &&add,
+        [HANDLER_CLO] = &&clo,
+        [HANDLER_CLZ] = &&clz,
+        [HANDLER_ADDU] = &&addu,
+        [HANDLER_SLT] = &&slt,
+        [HANDLER_LB] = &&lb,
+        [HANDLER_LH] = &&lh,
+        [HANDLER_LW] = &&lw,
+        [HANDLER_SB] = &&sb,
+        [HANDLER_SH] = &&sh,
+        [HANDLER_SW] = &&sw,
+        [HANDLER_PAST_END] = &&past_end,
+        [HANDLER_LUI_ORI] = &&lui_ori,
+        [HANDLER_SLT_BEQ] = &&slt_beq,
+        [HANDLER_SLT_BNE] = &&slt_bne,
+        [HANDLER_ADDI_BNE] = &&addi_bne,
+#define FUSED_LABEL_ADDRESS(name, length, a, b, c, d) \
+        [HANDLER_##name] = &&fused_##name,
+        GENERATED_SUPERINSTRUCTIONS(FUSED_LABEL_ADDRESS)
+#undef FUSED_LABEL_ADDRESS
+    };
+    void **threaded = data->threaded;
+    struct decoded_inst *inst;
+
+// Jumps straight to the handler of the next instruction in the block.
+#define DISPATCH() \
+    do { \
+        inst++; \
+        goto *threaded[data->index]; \
+    } while (0)
+#endif
+
+    while (1) {
+        if (block == NULL) {
+            block = find_block(blocks, data->code, data->index);
+            if (block == NULL) {
+                stop_run(data, IMPS_NO_MEMORY, "no memory for a new block");
+            }
+        }
+        if (executed >= limit) {
+            return;
+        }
+        executed += block->length;
+        if (block->tier < last_tier && 
+            ++block->executions >= promote_after[block->tier]) {
+            if (block->tier == TIER_INTERPRETED) {
+                uint32_t end = block->start + block->length;
+                fuse_superinstructions(data->code, fused, num_instructions,
+                                       block->start, end);
+#ifdef IMPS_THREADED
+                for (uint32_t i = block->start; i < end; i++) {
+                    threaded[i] = handler_labels[fused[i].handler];
+                }
+#endif
+                block->tier = TIER_THREADED;
+            }
+#ifdef IMPS_JIT
+            else {
+                // The JIT is only set up once something needs compiling.
+                if (jit == NULL) {
+                    jit = jit_create(data->code, executable, 
+                                     data->stack_bottom);
+                    data->jit = jit;
+                    data->jit_failed = jit == NULL;
+                }
+                if (jit == NULL) {
+                    // Blocks stay threaded.
+                    last_tier = TIER_THREADED;
+                } else if (jit_request(jit, block->start)) {
+                    block->tier = TIER_COMPILING;
+                } else {
+                    // The queue is full, ask again later.
+                    block->executions = 0;
+                }
+            }
+#endif
+        }
+
+#ifdef IMPS_JIT
+        // A block keeps running threaded until its compiled code is ready.
+        if (block->tier == TIER_COMPILING && 
+            jit_lookup(jit, block->start, &block->native)) {
+            if (block->native != NULL) {
+                block->tier = TIER_NATIVE;
+            } else {
+                // Nothing to compile at the start of this block.
+                block->tier = TIER_THREADED;
+                block->executions = 0;
+            }
+        }
+        if (block->tier == TIER_NATIVE) {
+            // Native code chains on into other compiled blocks, so where it
+            // stops has nothing to do with this block's exits.
+            jit_block entry = (jit_block)block->native;
+            uint64_t result = entry(data->registers, data->memory, 
+                                    data->direct_stack, 
+                                    data->direct_stack_length);
+            data->index = (uint32_t)result;
+            if (result & JIT_INTERPRET) {
+                execute_inst(&data->code[data->index], data, executable, 
+                             files, descriptors);
+            } else if (result >> JIT_EXIT_SHIFT != 0 && data->chain) {
+                jit_chain(jit, result >> JIT_EXIT_SHIFT, data->index);
+            }
+            block = NULL;
+            continue;
+        }
+#endif
+        if (block->tier == TIER_INTERPRETED) {
+            struct decoded_inst *inst = &data->code[block->start];
+            struct decoded_inst *end = inst + block->length;
+            while (inst < end) {
+                execute_inst(inst, data, executable, files, descriptors);
+                inst++;
+            }
+        } else {
+#ifdef IMPS_THREADED
+            inst = &fused[block->start];
+            goto *threaded[block->start];
+addi:
+            add_i_inst(inst, data);
+            DISPATCH();
+ori:
+            ori_inst(inst, data);
+            DISPATCH();
+lui:
+            lui_inst(inst, data);
+            DISPATCH();
+addiu:
+            addiu_inst(inst, data);
+            DISPATCH();
+mul:
+            mul_inst(inst, data);
+            DISPATCH();
+add:
+            add_inst(inst, data);
+            DISPATCH();
+clo:
+            clo_inst(inst, data);
+            DISPATCH();
+clz:
+            clz_inst(inst, data);
+            DISPATCH();
+addu:
+            addu_inst(inst, data);
+            DISPATCH();
+slt:
+            slt_inst(inst, data);
+            DISPATCH();
+lb:
+            lb_inst(inst, data, executable);
+            DISPATCH();
+lh:
+            lh_inst(inst, data, executable);
+            DISPATCH();
+lw:
+            lw_inst(inst, data, executable);
+            DISPATCH();
+sb:
+            sb_inst(inst, data, executable);
+            DISPATCH();
+sh:
+            sh_inst(inst, data, executable);
+            DISPATCH();
+sw:
+            sw_inst(inst, data, executable);
+            DISPATCH();
+lui_ori:
+            lui_ori_inst(inst, data);
+            inst++;
+            DISPATCH();
+slt_beq:
+            slt_beq_inst(inst, data);
+            goto block_end;
+slt_bne:
+            slt_bne_inst(inst, data);
+            goto block_end;
+addi_bne:
+            addi_bne_inst(inst, data);
+            goto block_end;
+// A generated superinstruction ends the block if its last part is a branch.
+#define FUSED_LABEL(name, length, a, b, c, d) \
+fused_##name: \
+            fused_##name##_inst(inst, data, executable); \
+            if (ends_block(HANDLER_##b) || ends_block(HANDLER_##c) || \
+                ends_block(HANDLER_##d)) { \
+                goto block_end; \
+            } \
+            inst += length - 1; \
+            DISPATCH();
+            GENERATED_SUPERINSTRUCTIONS(FUSED_LABEL)
+#undef FUSED_LABEL
+beq:
+            beq_inst(inst, data);
+            goto block_end;
+bne:
+            bne_inst(inst, data);
+            goto block_end;
+syscall:
+            syscall(data, executable, files, descriptors);
+            goto block_end;
+bad:
+            print_bad_instruction(inst->immediate, data);
+past_end:
+            print_past_end(data);
+#else
+            struct decoded_inst *inst = &fused[block->start];
+            struct decoded_inst *end = inst + block->length;
+            while (inst < end) {
+                uint32_t length = inst_length(inst->handler);
+                execute_inst(inst, data, executable, files, descriptors);
+                inst += length;
+            }
+#endif
+        }
+#ifdef IMPS_THREADED
+block_end:
+#endif
+        block = next_block(block, blocks, data->code, data->index);
+        if (block == NULL) {
+            stop_run(data, IMPS_NO_MEMORY, "no memory for a new block");
+        }
+    }
+#ifdef IMPS_THREADED
+#undef DISPATCH
+#endif
+}
+
+/**
+ * Returns the block that follows 'block' now that it has finished with 
+ * 'index' as the next instruction. The successor is found and chained to the
+ * exit the first time the exit is taken. Returns NULL if there is no memory
+ * for a new successor.
+ */
+static struct block *next_block(struct block *block, struct block **blocks,
+                                struct decoded_inst *code, uint32_t index) {
+    int exit = BLOCK_TAKEN;
+    if (index == block->start + block->length) {
+        exit = BLOCK_FALLTHROUGH;
+    }
+    if (block->next[exit] == NULL) {
+        block->next[exit] = find_block(blocks, code, index);
+    }
+    return block->next[exit];
+}
+
+/**
+ * Returns the cached block starting at 'start', creating it if this is the 
+ * first time 'start' is executed, or NULL if there is no memory to create it.
+ * A block ends with its first branch, syscall or bad instruction, or with 
+ * the sentinel after the last instruction.
+ */
+static struct block *find_block(struct block **blocks, 
+                                struct decoded_inst *code, uint32_t start) {
+    if (blocks[start] != NULL) {
+        return blocks[start];
+    }
+    uint32_t end = start;
+    while (!ends_block(code[end].handler)) {
+        end++;
+    }
+    end++;
+    struct block *block = malloc(sizeof(*block));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->start = start;
+    block->length = end - start;
+    block->tier = TIER_INTERPRETED;
+    block->executions = 0;
+    block->native = NULL;
+    block->next[BLOCK_FALLTHROUGH] = NULL;
+    block->next[BLOCK_TAKEN] = NULL;
+    blocks[start] = block;
+    return block;
+}
+
+/**
+ * Returns whether an instruction with the given handler ends a block.
+ */
+static bool ends_block(uint8_t handler) {
+    return handler == HANDLER_BEQ || handler == HANDLER_BNE || 
+           handler == HANDLER_SYSCALL || handler == HANDLER_BAD ||
+           handler == HANDLER_PAST_END;
+}
+
+/**
+ * Frees every cached block.
+ */
+static void free_blocks(struct block **blocks, uint32_t num_instructions) {
+    for (uint32_t i = 0; i <= num_instructions; i++) {
+        free(blocks[i]);
+    }
+    free(blocks);
+}
+
+/**
+ * Executes a single predecoded instruction.
+ */
+static IMPS_ALWAYS_INLINE void execute_inst(struct decoded_inst *inst, 
+                                             struct runtime_data *data,
+                                             struct imps_file *executable, 
+                                             struct file *files,
+                                             struct descriptor *descriptors) {
+    switch (inst->handler) {
+    case HANDLER_ADDI:
+        add_i_inst(inst, data);
+        break;
+    case HANDLER_ORI:
+        ori_inst(inst, data);
+        break;
+    case HANDLER_LUI:
+        lui_inst(inst, data);
+        break;
+    case HANDLER_ADDIU:
+        addiu_inst(inst, data);
+        break;
+    case HANDLER_MUL:
+        mul_inst(inst, data);
+        break;
+    case HANDLER_BEQ:
+        beq_inst(inst, data);
+        break;
+    case HANDLER_BNE:
+        bne_inst(inst, data);
+        break;
+    case HANDLER_SYSCALL:
+        syscall(data, executable, files, descriptors);
+        break;
+    case HANDLER_ADD:
+        add_inst(inst, data);
+        break;
+    case HANDLER_CLO:
+        clo_inst(inst, data);
+        break;
+    case HANDLER_CLZ:
+        clz_inst(inst, data);
+        break;
+    case HANDLER_ADDU:
+        addu_inst(inst, data);
+        break;
+    case HANDLER_SLT:
+        slt_inst(inst, data);
+        break;
+    case HANDLER_LB:
+        lb_inst(inst, data, executable);
+        break;
+    case HANDLER_LH:
+        lh_inst(inst, data, executable);
+        break;
+    case HANDLER_LW:
+        lw_inst(inst, data, executable);
+        break;
+    case HANDLER_SB:
+        sb_inst(inst, data, executable);
+        break;
+    case HANDLER_SH:
+        sh_inst(inst, data, executable);
+        break;
+    case HANDLER_SW:
+        sw_inst(inst, data, executable);
+        break;
+    case HANDLER_PAST_END:
+        print_past_end(data);
+        break;
+    case HANDLER_LUI_ORI:
+        lui_ori_inst(inst, data);
+        break;
+    case HANDLER_SLT_BEQ:
+        slt_beq_inst(inst, data);
+        break;
+    case HANDLER_SLT_BNE:
+        slt_bne_inst(inst, data);
+        break;
+    case HANDLER_ADDI_BNE:
+        addi_bne_inst(inst, data);
+        break;
+#define FUSED_CASE(name, length, a, b, c, d) \
+    case HANDLER_##name: \
+        fused_##name##_inst(inst, data, executable); \
+        break;
+    GENERATED_SUPERINSTRUCTIONS(FUSED_CASE)
+#undef FUSED_CASE
+    default:
+        print_bad_instruction(inst->immediate, data);
+    }
+}
+
+#ifdef IMPS_JIT
+/**
+ * Maps the code buffer and the per instruction block table and starts the 
+ * compile thread. Returns NULL if the host refuses to give out executable 
+ * memory or there is no memory for the tables.
+ */
+static struct jit *jit_create(struct decoded_inst *code, 
+                              struct imps_file *executable, 
+                              uint32_t stack_bottom) {
+    uint8_t *buffer;
+    uint8_t *exec;
+    if (!jit_map_buffer(&buffer, &exec)) {
+        return NULL;
+    }
+    struct jit *jit = malloc(sizeof(*jit));
+    if (jit == NULL) {
+        jit_unmap_buffer(buffer, exec);
+        return NULL;
+    }
+    jit->buffer = buffer;
+    jit->exec = exec;
+    jit->used = 0;
+    jit->code = code;
+    jit->executable = executable;
+    jit->stack_bottom = stack_bottom;
+    // Exits can lead to the sentinel, so it has an entry too.
+    jit->blocks = calloc(executable->num_instructions + 1, 
+                         sizeof(*jit->blocks));
+    jit->attempted = calloc(executable->num_instructions + 1, 
+                            sizeof(*jit->attempted));
+    if (jit->blocks == NULL || jit->attempted == NULL) {
+        jit_unmap_buffer(buffer, exec);
+        free(jit->blocks);
+        free(jit->attempted);
+        free(jit);
+        return NULL;
+    }
+#ifdef IMPS_JIT_THREAD
+    atomic_init(&jit->queue.head, 0);
+    atomic_init(&jit->queue.tail, 0);
+    atomic_init(&jit->stopping, false);
+    jit->pending_ready = sem_init(&jit->pending, 0, 0) == 0;
+    jit->threaded = jit->pending_ready &&
+                    pthread_create(&jit->thread, NULL, jit_compile_thread, 
+                                   jit) == 0;
+#endif
+    return jit;
+}
+
+/**
+ * Maps the code buffer twice: writable at 'buffer', where code is written 
+ * and patched, and executable at 'exec', where it runs, so no page is ever
+ * both. Switching the protection of one mapping instead would not work, as
+ * the compile thread writes new blocks while the block loop runs others in
+ * the same pages. Returns false if either mapping can't be made.
+ */
+static bool jit_map_buffer(uint8_t **buffer, uint8_t **exec) {
+    static atomic_uint num_buffers;
+    char name[64];
+    snprintf(name, sizeof(name), "/imps-jit-%ld-%u", (long)getpid(), 
+             atomic_fetch_add(&num_buffers, 1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return false;
+    }
+    shm_unlink(name);
+    *buffer = MAP_FAILED;
+    *exec = MAP_FAILED;
+    if (ftruncate(fd, JIT_BUFFER_SIZE) == 0) {
+        *buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, 
+                       MAP_SHARED, fd, 0);
+        *exec = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, 
+                     MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (*buffer == MAP_FAILED || *exec == MAP_FAILED) {
+        jit_unmap_buffer(*buffer, *exec);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Unmaps the views of the code buffer that were mapped.
+ */
+static void jit_unmap_buffer(uint8_t *buffer, uint8_t *exec) {
+    if (buffer != MAP_FAILED) {
+        munmap(buffer, JIT_BUFFER_SIZE);
+    }
+    if (exec != MAP_FAILED) {
+        munmap(exec, JIT_BUFFER_SIZE);
+    }
+}
+
+/**
+ * Stops the compile thread, unmaps the code buffer and frees the block 
+ * table.
+ */
+static void jit_destroy(struct jit *jit) {
+#ifdef IMPS_JIT_THREAD
+    if (jit->threaded) {
+        atomic_store(&jit->stopping, true);
+        sem_post(&jit->pending);
+        pthread_join(jit->thread, NULL);
+    }
+    if (jit->pending_ready) {
+        sem_destroy(&jit->pending);
+    }
+#endif
+    jit_unmap_buffer(jit->buffer, jit->exec);
+    free(jit->blocks);
+    free(jit->attempted);
+    free(jit);
+}
+
+/**
+ * Asks for the block starting at 'start' to be compiled. Returns false if 
+ * the request queue is full. The result can be picked up with jit_lookup.
+ */
+static bool jit_request(struct jit *jit, uint32_t start) {
+#ifdef IMPS_JIT_THREAD
+    if (jit->threaded) {
+        if (!jit_queue_push(&jit->queue, start)) {
+            return false;
+        }
+        sem_post(&jit->pending);
+        return true;
+    }
+#endif
+    jit_compile(jit, start);
+    return true;
+}
+
+/**
+ * Returns whether compiling the block starting at 'start' has finished, 
+ * and if so sets 'entry' to its code, or NULL if it could not be compiled.
+ */
+static bool jit_lookup(struct jit *jit, uint32_t start, uint8_t **entry) {
+    if (!atomic_load_explicit(&jit->attempted[start], memory_order_acquire)) {
+        return false;
+    }
+    *entry = atomic_load_explicit(&jit->blocks[start], memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Compiles the block starting at 'start' unless that has already been tried,
+ * then publishes it. Only ever runs on one thread at a time.
+ */
+static void jit_compile(struct jit *jit, uint32_t start) {
+    if (atomic_load_explicit(&jit->attempted[start], memory_order_relaxed)) {
+        return;
+    }
+    uint8_t *entry = jit_compile_block(jit, jit->code, jit->executable, 
+                                       start);
+    atomic_store_explicit(&jit->blocks[start], entry, memory_order_relaxed);
+    atomic_store_explicit(&jit->attempted[start], true, 
+                          memory_order_release);
+}
+
+#ifdef IMPS_JIT_THREAD
+/**
+ * Body of the compile thread. Compiles requested blocks in the order they 
+ * were asked for until the JIT is destroyed.
+ */
+static void *jit_compile_thread(void *arg) {
+    struct jit *jit = arg;
+    while (1) {
+        sem_wait(&jit->pending);
+        if (atomic_load(&jit->stopping)) {
+            return NULL;
+        }
+        uint32_t start;
+        while (jit_queue_pop(&jit->queue, &start)) {
+            jit_compile(jit, start);
+        }
+    }
+}
+
+/**
+ * Adds a block start to the queue. Returns false if the queue is full. Only
+ * called from the block loop.
+ */
+static bool jit_queue_push(struct jit_queue *queue, uint32_t start) {
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == JIT_QUEUE_SIZE) {
+        return false;
+    }
+    queue->starts[tail % JIT_QUEUE_SIZE] = start;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Takes the oldest block start off the queue. Returns false if the queue is
+ * empty. Only called from the compile thread.
+ */
+static bool jit_queue_pop(struct jit_queue *queue, uint32_t *start) {
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *start = queue->starts[head % JIT_QUEUE_SIZE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+#endif
+
+/**
+ * Patches the chainable exit at offset 'stub' in the code buffer to jump 
+ * straight past the prologue of the block at 'target', so the two blocks run
+ * without returning to the block loop. Does nothing if the target has not 
+ * been compiled yet. Only called from the block loop, which is not running
+ * any compiled code at the time.
+ */
+static void jit_chain(struct jit *jit, uint32_t stub, uint32_t target) {
+    if (target >= jit->executable->num_instructions) {
+        return;
+    }
+    // Cold targets are left alone until they are compiled themselves.
+    uint8_t *entry;
+    if (!jit_lookup(jit, target, &entry) || entry == NULL) {
+        return;
+    }
+    // jmp rel32, patched through the writable view.
+    uint8_t *exit = jit->buffer + stub;
+    int32_t rel = (int32_t)(entry + JIT_PROLOGUE_LEN - 
+                            (jit->exec + stub + JIT_JMP_LEN));
+    exit[0] = 0xE9;
+    memcpy(exit + 1, &rel, sizeof(rel));
+}
+
+/**
+ * Translates the basic block starting at 'start' into machine code. The block
+ * runs until a branch, a syscall or bad instruction, the end of the 
+ * instructions or JIT_MAX_BLOCK_LEN instructions. Returns NULL when there is
+ * nothing worth compiling or the code buffer is full.
+ *
+ * The generated code keeps the register file in rbx, guest memory in r12, the
+ * direct stack in r13 and its length in r14d and only uses eax, ecx and edx 
+ * as scratch registers.
+ */
+static uint8_t *jit_compile_block(struct jit *jit, struct decoded_inst *code,
+                                  struct imps_file *executable, 
+                                  uint32_t start) {
+    if (!jit_can_compile(code[start].handler) ||
+        JIT_BUFFER_SIZE - jit->used < JIT_MAX_BLOCK_BYTES) {
+        return NULL;
+    }
+    uint8_t *entry = jit->exec + jit->used;
+    struct jit_fixup fixups[JIT_MAX_BLOCK_LEN * JIT_MAX_FIXUPS];
+    int num_fixups = 0;
+
+    // push rbx; push r12; push r13; push r14
+    jit_emit_bytes(jit, 7, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+    // mov rbx, rdi; mov r12, rsi; mov r13, rdx; mov r14d, ecx
+    jit_emit_bytes(jit, 6, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4);
+    jit_emit_bytes(jit, 6, 0x49, 0x89, 0xD5, 0x41, 0x89, 0xCE);
+
+    uint32_t index = start;
+    bool ended = false;
+    while (!ended) {
+        if (index >= executable->num_instructions) {
+            // Let the dispatcher report running past the end.
+            jit_emit_exit(jit, index);
+            break;
+        }
+        if (index - start >= JIT_MAX_BLOCK_LEN) {
+            jit_emit_chain_exit(jit, index);
+            break;
+        }
+        struct decoded_inst *inst = &code[index];
+        if (!jit_can_compile(inst->handler)) {
+            jit_emit_exit(jit, (uint64_t)index | JIT_INTERPRET);
+            break;
+        }
+        switch (inst->handler) {
+        case HANDLER_BEQ:
+        case HANDLER_BNE:
+            jit_emit_branch(jit, inst, index);
+            ended = true;
+            break;
+        case HANDLER_LB:
+        case HANDLER_LH:
+        case HANDLER_LW:
+        case HANDLER_SB:
+        case HANDLER_SH:
+        case HANDLER_SW:
+            num_fixups += jit_emit_mem(jit, inst, executable, index, 
+                                       &fixups[num_fixups]);
+            break;
+        default:
+            num_fixups += jit_emit_arith(jit, inst, index, 
+                                         &fixups[num_fixups]);
+        }
+        index++;
+    }
+
+    // Error exits return to the interpreter at the failing instruction,
+    // which has not changed any state yet.
+    for (int i = 0; i < num_fixups; i++) {
+        int32_t rel = (int32_t)(jit->used - fixups[i].patch - sizeof(int32_t));
+        memcpy(jit->buffer + fixups[i].patch, &rel, sizeof(rel));
+        jit_emit_exit(jit, (uint64_t)fixups[i].index | JIT_INTERPRET);
+    }
+    return entry;
+}
+
+/**
+ * Returns whether an instruction with the given handler can be compiled.
+ */
+static bool jit_can_compile(uint8_t handler) {
+    return handler != HANDLER_SYSCALL && handler != HANDLER_BAD &&
+           handler != HANDLER_PAST_END;
+}
+
+/**
+ * Emits code for the arithmetic and logical instructions. Returns the number
+ * of error exits added to 'fixups'.
+ */
+static int jit_emit_arith(struct jit *jit, struct decoded_inst *inst,
+                          uint32_t index, struct jit_fixup *fixups) {
+    int num_fixups = 0;
+    switch (inst->handler) {
+    case HANDLER_ADDI:
+    case HANDLER_ADDIU:
+    case HANDLER_ORI:
+        if (inst->target == ZERO_REGISTER) {
+            break;
+        }
+        jit_load_reg(jit, JIT_EAX, inst->source);
+        // add eax, imm32 / or eax, imm32
+        jit_emit_byte(jit, inst->handler == HANDLER_ORI ? 0x0D : 0x05);
+        jit_emit_u32(jit, inst->immediate);
+        if (inst->handler == HANDLER_ADDI) {
+            // jo
+            num_fixups += jit_emit_fail_jump(jit, 0x80, index, fixups);
+        }
+        jit_store_reg(jit, JIT_EAX, inst->target);
+        break;
+    case HANDLER_LUI:
+        if (inst->target != ZERO_REGISTER) {
+            // mov dword [rbx + target], imm32
+            jit_emit_bytes(jit, 3, 0xC7, 0x43, inst->target * WORD_LEN);
+            jit_emit_u32(jit, inst->immediate);
+        }
+        break;
+    case HANDLER_ADD:
+    case HANDLER_ADDU:
+    case HANDLER_MUL:
+        if (inst->destination == ZERO_REGISTER) {
+            break;
+        }
+        jit_load_reg(jit, JIT_EAX, inst->source);
+        if (inst->handler == HANDLER_MUL) {
+            // imul eax, [rbx + target]
+            jit_emit_bytes(jit, 4, 0x0F, 0xAF, 0x43, inst->target * WORD_LEN);
+        } else {
+            // add eax, [rbx + target]
+            jit_emit_bytes(jit, 3, 0x03, 0x43, inst->target * WORD_LEN);
+        }
+        if (inst->handler == HANDLER_ADD) {
+            // jo
+            num_fixups += jit_emit_fail_jump(jit, 0x80, index, fixups);
+        }
+        jit_store_reg(jit, JIT_EAX, inst->destination);
+        break;
+    case HANDLER_SLT:
+        if (inst->destination == ZERO_REGISTER) {
+            break;
+        }
+        jit_load_reg(jit, JIT_ECX, inst->source);
+        // xor eax, eax; cmp ecx, [rbx + target]; setl al
+        jit_emit_bytes(jit, 5, 0x31, 0xC0, 0x3B, 0x4B, 
+                       inst->target * WORD_LEN);
+        jit_emit_bytes(jit, 3, 0x0F, 0x9C, 0xC0);
+        jit_store_reg(jit, JIT_EAX, inst->destination);
+        break;
+    case HANDLER_CLO:
+    case HANDLER_CLZ:
+        if (inst->destination == ZERO_REGISTER) {
+            break;
+        }
+        jit_load_reg(jit, JIT_EAX, inst->source);
+        if (inst->handler == HANDLER_CLO) {
+            // not eax
+            jit_emit_bytes(jit, 2, 0xF7, 0xD0);
+        }
+        // mov edx, 32; bsr ecx, eax; jz +7; mov edx, 31; sub edx, ecx
+        jit_emit_byte(jit, 0xBA);
+        jit_emit_u32(jit, 32);
+        jit_emit_bytes(jit, 5, 0x0F, 0xBD, 0xC8, 0x74, 0x07);
+        jit_emit_byte(jit, 0xBA);
+        jit_emit_u32(jit, 31);
+        jit_emit_bytes(jit, 2, 0x29, 0xCA);
+        jit_store_reg(jit, JIT_EDX, inst->destination);
+        break;
+    }
+    return num_fixups;
+}
+
+/**
+ * Emits code for a load or store, including the same range and alignment 
+ * checks as address_check. Addresses outside the data segment are checked 
+ * against the direct stack next, so only the heap and addresses the stack
+ * can't take yet leave compiled code. Returns the number of error exits 
+ * added to 'fixups'.
+ */
+static int jit_emit_mem(struct jit *jit, struct decoded_inst *inst,
+                        struct imps_file *executable, uint32_t index,
+                        struct jit_fixup *fixups) {
+    int num_bytes = BYTE_LEN;
+    if (inst->handler == HANDLER_LH || inst->handler == HANDLER_SH) {
+        num_bytes = HALF_WORD_LEN;
+    } else if (inst->handler == HANDLER_LW || inst->handler == HANDLER_SW) {
+        num_bytes = WORD_LEN;
+    }
+    int num_fixups = 0;
+
+    // eax = address - MEMORY_START, anything below MEMORY_START wraps around
+    // to a value larger than the limit.
+    jit_load_reg(jit, JIT_EAX, inst->source);
+    jit_emit_byte(jit, 0x05);
+    jit_emit_u32(jit, inst->immediate);
+    jit_emit_byte(jit, 0x2D);
+    jit_emit_u32(jit, MEMORY_START);
+    // cmp eax, limit; jae to the stack check
+    uint32_t limit = executable->memory_size + (num_bytes - 1);
+#ifdef IMPS_GUARD_MEMORY
+    // Nothing past the end of the data is mapped, so accesses that would
+    // reach it are left to the interpreter to fault on.
+    limit = executable->memory_size >= (uint32_t)(num_bytes - 1) ? 
+            executable->memory_size - (num_bytes - 1) : 0;
+#endif
+    jit_emit_byte(jit, 0x3D);
+    jit_emit_u32(jit, limit);
+    jit_emit_bytes(jit, 2, 0x73, 0);
+    uint32_t to_stack = jit->used;
+    if (num_bytes != BYTE_LEN) {
+        // test eax, num_bytes - 1; jne
+        jit_emit_byte(jit, 0xA9);
+        jit_emit_u32(jit, num_bytes - 1);
+        num_fixups += jit_emit_fail_jump(jit, 0x85, index, 
+                                         &fixups[num_fixups]);
+    }
+    // [r12 + rax]
+    jit_emit_access(jit, inst, 0x41, 0x04);
+    // jmp over the stack access
+    jit_emit_bytes(jit, 2, 0xEB, 0);
+    uint32_t to_end = jit->used;
+    jit->buffer[to_stack - 1] = (uint8_t)(jit->used - to_stack);
+
+    // edx = address - stack_bottom, which is below the length in r14d only
+    // on the stack. The length is a whole number of pages, so an aligned
+    // access that starts below it also ends below it.
+    jit_emit_bytes(jit, 2, 0x8D, 0x90);
+    jit_emit_u32(jit, MEMORY_START - jit->stack_bottom);
+    // cmp edx, r14d; jae
+    jit_emit_bytes(jit, 3, 0x44, 0x39, 0xF2);
+    num_fixups += jit_emit_fail_jump(jit, 0x83, index, &fixups[num_fixups]);
+    if (num_bytes != BYTE_LEN) {
+        // test edx, num_bytes - 1; jne
+        jit_emit_bytes(jit, 2, 0xF7, 0xC2);
+        jit_emit_u32(jit, num_bytes - 1);
+        num_fixups += jit_emit_fail_jump(jit, 0x85, index, 
+                                         &fixups[num_fixups]);
+    }
+    // [rdx + r13]
+    jit_emit_access(jit, inst, 0x42, 0x2A);
+    jit->buffer[to_end - 1] = (uint8_t)(jit->used - to_end);
+    return num_fixups;
+}
+
+/**
+ * Emits the access of a load or store to the memory operand given by the
+ * REX prefix 'rex' and SIB byte 'sib', written [base + index] below.
+ */
+static void jit_emit_access(struct jit *jit, struct decoded_inst *inst,
+                            uint8_t rex, uint8_t sib) {
+    switch (inst->handler) {
+    case HANDLER_LB:
+    case HANDLER_LH:
+    case HANDLER_LW:
+        if (inst->target == ZERO_REGISTER) {
+            break;
+        }
+        if (inst->handler == HANDLER_LB) {
+            // movsx ecx, byte [base + index]
+            jit_emit_bytes(jit, 5, rex, 0x0F, 0xBE, 0x0C, sib);
+        } else if (inst->handler == HANDLER_LH) {
+            // movsx ecx, word [base + index]
+            jit_emit_bytes(jit, 5, rex, 0x0F, 0xBF, 0x0C, sib);
+        } else {
+            // mov ecx, [base + index]
+            jit_emit_bytes(jit, 4, rex, 0x8B, 0x0C, sib);
+        }
+        jit_store_reg(jit, JIT_ECX, inst->target);
+        break;
+    default:
+        jit_load_reg(jit, JIT_ECX, inst->target);
+        if (inst->handler == HANDLER_SB) {
+            // mov [base + index], cl
+            jit_emit_bytes(jit, 4, rex, 0x88, 0x0C, sib);
+        } else if (inst->handler == HANDLER_SH) {
+            // mov [base + index], cx
+            jit_emit_bytes(jit, 5, 0x66, rex, 0x89, 0x0C, sib);
+        } else {
+            // mov [base + index], ecx
+            jit_emit_bytes(jit, 4, rex, 0x89, 0x0C, sib);
+        }
+    }
+}
+
+/**
+ * Emits code for a beq or bne, ending the block with one exit for falling 
+ * through and one for the taken branch.
+ */
+static void jit_emit_branch(struct jit *jit, struct decoded_inst *inst,
+                            uint32_t index) {
+    jit_load_reg(jit, JIT_EAX, inst->source);
+    // cmp eax, [rbx + target]; je / jne over the fall through exit
+    jit_emit_bytes(jit, 3, 0x3B, 0x43, inst->target * WORD_LEN);
+    jit_emit_bytes(jit, 2, inst->handler == HANDLER_BEQ ? 0x74 : 0x75, 
+                   JIT_EXIT_SKIP);
+    jit_emit_chain_exit(jit, index + 1);
+    jit_emit_chain_exit(jit, index + inst->immediate);
+}
+
+/**
+ * Emits a conditional jump to an error exit, to be patched once the exit has 
+ * been emitted. Returns the number of fixups added.
+ */
+static int jit_emit_fail_jump(struct jit *jit, uint8_t condition, 
+                              uint32_t index, struct jit_fixup *fixup) {
+    jit_emit_bytes(jit, 2, 0x0F, condition);
+    fixup->patch = jit->used;
+    fixup->index = index;
+    jit_emit_u32(jit, 0);
+    return 1;
+}
+
+/**
+ * Emits code returning 'result' from the block.
+ */
+static void jit_emit_exit(struct jit *jit, uint64_t result) {
+    // mov rax, imm64
+    jit_emit_bytes(jit, 2, 0x48, 0xB8);
+    jit_emit_u32(jit, (uint32_t)result);
+    jit_emit_u32(jit, (uint32_t)(result >> 32));
+    jit_emit_epilogue(jit);
+}
+
+/**
+ * Emits an exit to 'target' that can later be chained. The exit is 
+ * JIT_EXIT_SKIP bytes long, enough to be overwritten with a jmp rel32, and
+ * returns its own offset in the code buffer for jit_chain. The offset is 
+ * never 0, since every block starts with its prologue.
+ */
+static void jit_emit_chain_exit(struct jit *jit, uint32_t target) {
+    jit_emit_exit(jit, target | (uint64_t)jit->used << JIT_EXIT_SHIFT);
+}
+
+/**
+ * Emits the block epilogue: pop r14; pop r13; pop r12; pop rbx; ret
+ */
+static void jit_emit_epilogue(struct jit *jit) {
+    jit_emit_bytes(jit, 8, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+}
+
+/**
+ * Emits mov 'host', [rbx + 4 * 'guest'].
+ */
+static void jit_load_reg(struct jit *jit, uint8_t host, uint8_t guest) {
+    jit_emit_bytes(jit, 3, 0x8B, 0x43 | (host << 3), guest * WORD_LEN);
+}
+
+/**
+ * Emits mov [rbx + 4 * 'guest'], 'host'.
+ */
+static void jit_store_reg(struct jit *jit, uint8_t host, uint8_t guest) {
+    jit_emit_bytes(jit, 3, 0x89, 0x43 | (host << 3), guest * WORD_LEN);
+}
+
+/**
+ * Appends 'count' bytes, given as variable arguments, to the code buffer.
+ */
+static void jit_emit_bytes(struct jit *jit, int count, ...) {
+    va_list bytes;
+    va_start(bytes, count);
+    for (int i = 0; i < count; i++) {
+        jit_emit_byte(jit, va_arg(bytes, int));
+    }
+    va_end(bytes);
+}
+
+/**
+ * Appends a single byte to the code buffer.
+ */
+static void jit_emit_byte(struct jit *jit, uint8_t byte) {
+    jit->buffer[jit->used++] = byte;
+}
+
+/**
+ * Appends a little endian 32 bit value to the code buffer.
+ */
+static void jit_emit_u32(struct jit *jit, uint32_t value) {
+    for (int i = 0; i < WORD_LEN; i++) {
+        jit_emit_byte(jit, (value >> (BYTE_SIZE * i)) & UINT8_MASK);
+    }
+}
+#endif
+
+/**
+ * Decodes every instruction of the executable once, so the execution loop
+ * only has to look at the handler id and the already extracted fields.
+ * Returns NULL if there is no memory for them.
+ */
+static struct decoded_inst *predecode(struct imps_file *executable) {
+    struct decoded_inst *code = 
+        malloc((executable->num_instructions + 1) * sizeof(*code));
+    if (code == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < executable->num_instructions; i++) {
+        decode_inst(executable->instructions[i], &code[i]);
+    }
+    verify_code(code, executable->num_instructions);
+    return code;
+}
+
+/**
+ * Verifies the predecoded instructions so the execution loops never have to
+ * check where execution is going. Bad encodings already have a handler of 
+ * their own that reports them. Every branch target is worked out here, and
+ * branches that leave the instructions are pointed at a sentinel after the
+ * last instruction instead, which running off the end also reaches. Running
+ * the sentinel reports execution past the end, so the error is unchanged.
+ */
+static void verify_code(struct decoded_inst *code, uint32_t num_instructions) {
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        if (code[i].handler == HANDLER_BEQ || code[i].handler == HANDLER_BNE) {
+            uint32_t target = i + code[i].immediate;
+            if (target >= num_instructions) {
+                code[i].immediate = num_instructions - i;
+            }
+        }
+    }
+    code[num_instructions] = (struct decoded_inst){.handler = HANDLER_PAST_END};
+}
+
+/**
+ * Peephole pass replacing common instruction sequences from 'start' up to 
+ * 'end' with superinstructions, so one dispatch runs them all. The result is
+ * written to 'fused', a copy of 'code'. Only the first instruction of a 
+ * sequence changes; the rest keep their own records, so branching to them or
+ * starting a block at them still works.
+ */
+static void fuse_superinstructions(struct decoded_inst *code, 
+                                   struct decoded_inst *fused,
+                                   uint32_t num_instructions, uint32_t start,
+                                   uint32_t end) {
+    for (uint32_t i = start; i < end && i + 1 < num_instructions; i++) {
+        uint8_t handler = generated_handler(code, num_instructions, i);
+        if (handler == HANDLER_BAD) {
+            handler = fused_handler(code[i].handler, code[i + 1].handler);
+        }
+        if (handler != HANDLER_BAD) {
+            fused[i].handler = handler;
+        }
+    }
+}
+
+/**
+ * Returns the first generated superinstruction whose pattern matches the
+ * instructions starting at 'index', or HANDLER_BAD if none does.
+ */
+static uint8_t generated_handler(struct decoded_inst *code, 
+                                 uint32_t num_instructions, uint32_t index) {
+    for (const struct fused_pattern *pattern = fused_patterns; 
+         pattern->length != 0; pattern++) {
+        if (index + pattern->length > num_instructions) {
+            continue;
+        }
+        int part = 0;
+        while (part < pattern->length && 
+               code[index + part].handler == pattern->parts[part]) {
+            part++;
+        }
+        if (part == pattern->length) {
+            return pattern->handler;
+        }
     }
-    executable->instructions = instructions;
+    return HANDLER_BAD;
+}
 
-    // Store all debug offsets
-    uint32_t *debug_offsets = malloc(num_instructions * sizeof(uint32_t));
-    for (int i = 0; i < num_instructions; i++) {
-        debug_offsets[i] = get_lit_end_int(input_stream, DEBUG_OFFSET_LEN);
+/**
+ * Returns the superinstruction for an instruction followed by another, or
+ * HANDLER_BAD if the pair is not fused. These are the pairs compilers emit
+ * constantly: li and la (lui, ori), blt and bge (slt, bne or beq) and loop
+ * counters (addi, bne).
+ */
+static uint8_t fused_handler(uint8_t first, uint8_t second) {
+    if (first == HANDLER_LUI && second == HANDLER_ORI) {
+        return HANDLER_LUI_ORI;
+    } else if (first == HANDLER_SLT && second == HANDLER_BEQ) {
+        return HANDLER_SLT_BEQ;
+    } else if (first == HANDLER_SLT && second == HANDLER_BNE) {
+        return HANDLER_SLT_BNE;
+    } else if (first == HANDLER_ADDI && second == HANDLER_BNE) {
+        return HANDLER_ADDI_BNE;
     }
-    executable->debug_offsets = debug_offsets;
-
-    // Get the memory size
-    executable->memory_size = 
-        get_lit_end_int(input_stream, MEMORY_SIZE_LEN) & UINT16_MASK;   
-
-    // Store all initial data
-    uint8_t *initial_data = malloc(executable->memory_size);
-    fread(initial_data, sizeof(uint8_t), executable->memory_size, input_stream);
-    executable->initial_data = initial_data;
+    return HANDLER_BAD;
+}
 
-    fclose(input_stream);
+/**
+ * Returns the number of instructions run by a single dispatch of 'handler'.
+ */
+static IMPS_ALWAYS_INLINE uint32_t inst_length(uint8_t handler) {
+    switch (handler) {
+    case HANDLER_LUI_ORI:
+    case HANDLER_SLT_BEQ:
+    case HANDLER_SLT_BNE:
+    case HANDLER_ADDI_BNE:
+        return 2;
+#define FUSED_LENGTH(name, length, a, b, c, d) \
+    case HANDLER_##name: \
+        return length;
+    GENERATED_SUPERINSTRUCTIONS(FUSED_LENGTH)
+#undef FUSED_LENGTH
+    default:
+        return 1;
+    }
 }
 
 /**
- * Checks the magic number of a given file to determine whether the file path
- * is valid. Exits if invalid with an error.
+ * Determines the handler of a single instruction from its opcode and 
+ * extracts its register fields and immediate value.
  */
-static void check_magic_number(FILE *input_stream) {
-    uint8_t valid_check[MAGIC_NUM_SIZE];
-    if (fread(valid_check, 1, sizeof(valid_check), input_stream) != 
-        MAGIC_NUM_SIZE || 
-        valid_check[0] != MAGIC_BYTE_0 || valid_check[1] != MAGIC_BYTE_1 ||
-        valid_check[2] != MAGIC_BYTE_2 || valid_check[3] != MAGIC_BYTE_3) {
-            fprintf(stderr, "Invalid IMPS file\n");
-            fclose(input_stream);
-            exit(EXIT_FAILURE);
-    }    
+static void decode_inst(uint32_t execute, struct decoded_inst *inst) {
+    uint8_t opcode = (execute >> OPCODE_SHIFT) & OPCODE_MASK;
+    inst->source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
+    inst->target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
+    inst->destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+    inst->immediate = sign_extend(execute & IMMEDIATE_MASK);
+
+    if (opcode == ADDI_INST) {
+        inst->handler = HANDLER_ADDI;
+    } else if (opcode == FUNCT_CHECK) {
+        decode_funct(execute, inst);
+    } else if (opcode == ORI_INST) {
+        inst->handler = HANDLER_ORI;
+        inst->immediate = execute & IMMEDIATE_MASK;
+    } else if (opcode == LUI_INST) {
+        inst->handler = HANDLER_LUI;
+        inst->immediate <<= LUI_SHIFT;
+    } else if (opcode == ADDIU_INST) {
+        inst->handler = HANDLER_ADDIU;
+    } else if (opcode == MUL_INST) {
+        inst->handler = HANDLER_MUL;
+    } else if (opcode == BEQ_INST) {
+        inst->handler = HANDLER_BEQ;
+    } else if (opcode == BNE_INST) {
+        inst->handler = HANDLER_BNE;
+    } else {
+        decode_mem(execute, inst);
+    }
 }
 
 /**
- * Helper function used to return a little endian unsigned integer given a 
- * position in the file.
+ * Check the function bit pattern for instructions with the same opcode for an
+ * r-type instruction.
+ * If the instruction's function does not exist, then it is decoded as a bad
+ * instruction.
  */
-static uint32_t get_lit_end_int(FILE *input_stream, int num_bytes) {
-    uint32_t num = 0;
-    for (int i = 0; i < num_bytes; i++) {
-        num |= (uint32_t)fgetc(input_stream) << (BYTE_SIZE * i);
+static void decode_funct(uint32_t execute, struct decoded_inst *inst) {
+    uint8_t funct = execute & FUNCT_MASK;
+    if (funct == SYSCALL_INST) {
+        inst->handler = HANDLER_SYSCALL;
+    } else if (funct == ADD_INST) {
+        inst->handler = HANDLER_ADD;
+    } else if (funct == CLO_INST) {
+        inst->handler = HANDLER_CLO;
+    } else if (funct == CLZ_INST) {
+        inst->handler = HANDLER_CLZ;
+    } else if (funct == ADDU_INST) {
+        inst->handler = HANDLER_ADDU;
+    } else if (funct == SLT_INST) {
+        inst->handler = HANDLER_SLT;
+    } else {
+        inst->handler = HANDLER_BAD;
+        inst->immediate = execute;
     }
-    return num;
 }
 
 /**
- * Execute an IMPS program, determines required instructions and executes
- * corresponding required functions and memory access.
+ * Function that checks the opcode of all memory related instructions.
+ * If the opcode is not valid, then it is decoded as a bad instruction.
  */
-void execute_imps(struct imps_file *executable, int trace_mode, char *path) {
-    // Initialise register and run time data.
-    struct runtime_data *data = malloc(sizeof(*data));
-    data->registers = calloc(NUM_REGISTERS, sizeof(uint32_t));
-    data->prev_registers = calloc(NUM_REGISTERS, sizeof(uint32_t));
-    data->index = executable->entry_point;
+static void decode_mem(uint32_t execute, struct decoded_inst *inst) {
+    uint8_t opcode = (execute >> OPCODE_SHIFT) & OPCODE_MASK;
 
-    // Initialise file system in memory.
-    struct file *files = malloc(MAX_FILE_NUM * sizeof(*files));
-    struct descriptor *descriptors = 
-        malloc(MAX_DESC_NUM * sizeof(*descriptors));
-    initialise_files(files, descriptors);
+    if (opcode == LB_INST) {
+        inst->handler = HANDLER_LB;
+    } else if (opcode == LH_INST) {
+        inst->handler = HANDLER_LH;
+    } else if (opcode == LW_INST) {
+        inst->handler = HANDLER_LW;
+    } else if (opcode == SB_INST) {
+        inst->handler = HANDLER_SB;
+    } else if (opcode == SH_INST) {
+        inst->handler = HANDLER_SH;
+    } else if (opcode == SW_INST) {
+        inst->handler = HANDLER_SW;
+    } else {
+        inst->handler = HANDLER_BAD;
+        inst->immediate = execute;
+    }
+}
 
-    while (1) {
-        if (data->index >= executable->num_instructions) {
-            print_past_end(data, files, descriptors);
-        }
-        // If trace mode is on, make a copy of the registers.
-        if (trace_mode == 1) {
-            trace(data, executable, path);
-            memcpy(data->prev_registers, data->registers, 
-                NUM_REGISTERS * sizeof(uint32_t));
-        }
-        uint32_t execute = executable->instructions[data->index];
-        uint8_t opcode = (execute >> OPCODE_SHIFT) & OPCODE_MASK;
-        if (opcode == ADDI_INST) {
-            add_i_inst(execute, data);
-        } else if (opcode == FUNCT_CHECK) {
-            funct_check(execute, data, executable, files, descriptors);
-        } else if (opcode == ORI_INST) {
-            ori_inst(execute, data);
-        } else if (opcode == LUI_INST) {
-            lui_inst(execute, data);
-        } else if (opcode == ADDIU_INST) {
-            addiu_inst(execute, data);
-        } else if (opcode == MUL_INST) {
-            mul_inst(execute, data);
-        } else if (opcode == BEQ_INST) {
-            beq_inst(execute, data);
-        } else if (opcode == BNE_INST) {
-            bne_inst(execute, data);
-        } else {
-            mem_inst(execute, data, executable, files, descriptors);
-        }
-        if (trace_mode == 1) {
-            print_modified(data);
-        }
+/**
+ * Sign extends a 16 bit immediate value to 32 bits.
+ */
+static uint32_t sign_extend(uint32_t immediate) {
+    if ((immediate >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
+        immediate -= SIGN_BIT_EXTENSION;
     }
+    return immediate;
 }
 
 /**
@@ -428,14 +5639,11 @@ static void initialise_files(struct file *files,
 }
 
 /**
- * If the end of the instructions array is accessed, an error should be 
- * produced and allocated memory is freed before exiting with status 1.
+ * If the end of the instructions array is accessed, the run stops with an 
+ * error.
  */
-static void print_past_end(struct runtime_data *data, struct file *files, 
-                           struct descriptor *descriptors) {
-    fprintf(stderr, "IMPS error: execution past the end of instructions\n");
-    free_data(data, files, descriptors);
-    exit(EXIT_FAILURE);
+static void print_past_end(struct runtime_data *data) {
+    stop_run(data, IMPS_ERROR, "execution past the end of instructions");
 }
 
 /**
@@ -443,16 +5651,35 @@ static void print_past_end(struct runtime_data *data, struct file *files,
  */
 static void free_data(struct runtime_data *data, struct file *files, 
                      struct descriptor *descriptors) {
+#ifdef IMPS_JIT
+    if (data->jit != NULL) {
+        jit_destroy(data->jit);
+    }
+#endif
+    if (data->blocks != NULL) {
+        free_blocks(data->blocks, data->num_instructions);
+    }
+    free(data->fused);
+#ifdef IMPS_THREADED
+    free(data->threaded);
+#endif
+#ifdef IMPS_GUARD_MEMORY
+    if (guarded_run == data) {
+        guarded_run = NULL;
+    }
+#endif
+    free_memory(data);
     free(data->registers);
     free(data->prev_registers);
     free(data);
-    for (int i = 0; i < MAX_FILE_NUM; i++) {
+    for (int i = 0; files != NULL && i < MAX_FILE_NUM; i++) {
         free(files[i].path);
     }
     free(files);
     free(descriptors);
 }
 
+#ifndef IMPS_LIBRARY
 /**
  * Opens the corresponding assembly source file if it exists and prints out 
  * the instruction.
@@ -479,61 +5706,29 @@ static void trace(struct runtime_data *data, struct imps_file *executable,
     }
     fclose(trace_stream);
 }
+#endif
 
 /**
  * Stores the sum value of a register and an immediate value in the target 
  * register. Performs an overflow check.
  */
-static void add_i_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t immediate = execute & IMMEDIATE_MASK;
-    if ((immediate >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        immediate -= SIGN_BIT_EXTENSION;
-    }
+static void add_i_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (target != ZERO_REGISTER) {
-        overflow_check(immediate, registers[source]);   
-        registers[target] = registers[source] + immediate;
+    if (inst->target != ZERO_REGISTER) {
+        overflow_check(data, inst->immediate, registers[inst->source]);   
+        registers[inst->target] = registers[inst->source] + inst->immediate;
     }
     data->index++;
 }
 
 /**
  * Checks if the addition of two values will result in an integer overflow.
- * Exits with status 1 if an overflow is detected.
+ * Stops the run with an error if an overflow is detected.
  */
-static void overflow_check(int value1, int value2) {
+static void overflow_check(struct runtime_data *data, int value1, int value2) {
     if ((value1 > 0 && value2 > INT32_MAX - value1) || 
         (value1 < 0 && value2 < INT32_MIN - value1)) {
-        fprintf(stderr, "IMPS error: addition would overflow\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-/**
- * Check the function bit pattern for instructions with the same opcode for an
- * r-type instruction.
- * If the instruction's function does not exist, then print an error.
- */
-static void funct_check(uint32_t execute, struct runtime_data *data, 
-                        struct imps_file *executable, struct file *files,
-                        struct descriptor *descriptors) {
-    uint8_t funct = execute & FUNCT_MASK;
-    if (funct == SYSCALL_INST) {
-        syscall(data, executable, files, descriptors);
-    } else if (funct == ADD_INST) {
-        add_inst(execute, data);
-    } else if (funct == CLO_INST) {
-        clo_inst(execute, data);
-    } else if (funct == CLZ_INST) {
-        clz_inst(execute, data);
-    } else if (funct == ADDU_INST) {
-        addu_inst(execute, data);
-    } else if (funct == SLT_INST) {
-        slt_inst(execute, data);
-    } else {
-        print_bad_instruction(execute, data, files, descriptors);
+        stop_run(data, IMPS_ERROR, "addition would overflow");
     }
 }
 
@@ -543,14 +5738,19 @@ static void funct_check(uint32_t execute, struct runtime_data *data,
 static void syscall(struct runtime_data *data, struct imps_file *executable, 
                     struct file *files, struct descriptor *descriptors) {
     if (data->registers[V0] == SYSCALL_1) {
-        print_int32_in_decimal(stdout, data->registers[A0]);
+        char digits[INT32_DECIMAL_LEN];
+        char *end = digits + INT32_DECIMAL_LEN;
+        char *start = format_int32(end, data->registers[A0]);
+        data->write(data->io_context, start, end - start);
     } else if (data->registers[V0] == SYSCALL_4) {
         print_string(data, executable);
+    } else if (data->registers[V0] == SYSCALL_9) {
+        extend_heap(data);
     } else if (data->registers[V0] == SYSCALL_10) {
-        free_data(data, files, descriptors);
-        exit(EXIT_SUCCESS);
+        stop_run(data, IMPS_EXITED, NULL);
     } else if (data->registers[V0] == SYSCALL_11) {
-        putchar(data->registers[A0]);
+        char ch = data->registers[A0];
+        data->write(data->io_context, &ch, 1);
     } else if (data->registers[V0] == SYSCALL_12) {
         read_char(data);
     } else if (data->registers[V0] == SYSCALL_13) {
@@ -562,34 +5762,85 @@ static void syscall(struct runtime_data *data, struct imps_file *executable,
     } else if (data->registers[V0] == SYSCALL_16) {
         close_file(data, files, descriptors, executable);
     } else {
-        fprintf(stderr, "IMPS error: bad syscall number\n");
-        free_data(data, files, descriptors);
-        exit(EXIT_FAILURE);
+        stop_run(data, IMPS_ERROR, "bad syscall number");
     }
     data->index++;
 }
 
 /**
- * Prints the nul-terminated string at address $a0 to sdout.
+ * Prints the nul-terminated string at address $a0 to sdout. The terminator
+ * is found with one memchr over each run of accessible bytes from 
+ * string_run, and each run is written at once, so a string in the data 
+ * segment takes one scan and one write. A string that runs off the end of 
+ * accessible memory is printed up to there and then stops with a bad 
+ * address, unless the byte past the end happens to be 0.
  */
 static void print_string(struct runtime_data *data, 
                         struct imps_file *executable) {
     uint32_t address = data->registers[A0];
-    address_check(address, executable, BYTE_LEN);
-    int index = address - MEMORY_START;
+    address_check(data, address, executable, BYTE_LEN);
+
+    size_t length = 0;
+    uint8_t *bytes = string_run(data, address, executable, &length);
+    while (length > 0) {
+        uint8_t *end = memchr(bytes, '\0', length);
+        if (end != NULL) {
+            if (end > bytes) {
+                data->write(data->io_context, (char *)bytes, end - bytes);
+            }
+            return;
+        }
+        data->write(data->io_context, (char *)bytes, length);
+        address += length;
+        bytes = string_run(data, address, executable, &length);
+    }
+    if (peek_byte(data, address, executable) != '\0') {
+        bad_address(data, address, BYTE_LEN);
+    }
+}
 
-    while (executable->initial_data[index] != '\0') {
-        address_check(index + MEMORY_START, executable, BYTE_LEN);
-        putchar(executable->initial_data[index]);
-        index++;
-    }                            
+/**
+ * Returns where the bytes from 'address' are, storing in 'length' how many
+ * of them can be read at once: up to the end of the data segment, the heap
+ * or the stack, and without IMPS_GUARD_MEMORY outside the data segment only
+ * up to the end of the page. 'length' is 0 if 'address' can't be accessed.
+ */
+static uint8_t *string_run(struct runtime_data *data, uint32_t address,
+                           struct imps_file *executable, size_t *length) {
+    uint32_t offset = address - MEMORY_START;
+    uint64_t remaining = 0;
+    if (data->sparse) {
+        remaining = ((uint64_t)1 << 32) - address;
+    } else if (offset < executable->memory_size) {
+        remaining = executable->memory_size - offset;
+    } else if (address >= HEAP_START && address < data->heap_break) {
+        remaining = data->heap_break - address;
+    } else if (address >= data->stack_bottom && address < STACK_TOP) {
+        remaining = STACK_TOP - address;
+    }
+#ifdef IMPS_GUARD_MEMORY
+    *length = remaining;
+    return data->memory + offset;
+#else
+    if (offset < executable->memory_size) {
+        *length = executable->memory_size - offset;
+        return data->memory + offset;
+    }
+    uint32_t in_page = GUEST_PAGE_SIZE - (address & (GUEST_PAGE_SIZE - 1));
+    *length = remaining < in_page ? remaining : in_page;
+    if (*length == 0) {
+        return NULL;
+    }
+    return find_page(data, address, false) + 
+           (address & (GUEST_PAGE_SIZE - 1));
+#endif
 }
 
 /**
- * Reads a single character from stdin and places that character in $v0.
+ * Reads a single character of input and places that character in $v0.
  */
 static void read_char(struct runtime_data *data) {
-    uint32_t read_char = getchar();
+    uint32_t read_char = data->read(data->io_context);
     if (read_char == EOF) {
         data->registers[V0] = -1;
     } else {
@@ -598,28 +5849,227 @@ static void read_char(struct runtime_data *data) {
 }
 
 /**
- * Checks if access of a particular size of data is valid in existing memory.
+ * Moves the heap break up by $a0 bytes, rounded up to a whole word, and 
+ * places the old break in $v0. The heap can't shrink or grow past 
+ * HEAP_MAX_SIZE bytes.
+ */
+static void extend_heap(struct runtime_data *data) {
+    int32_t amount = data->registers[A0];
+    uint64_t end = data->heap_break + 
+                   (((uint64_t)amount + WORD_LEN - 1) & 
+                    ~(uint64_t)(WORD_LEN - 1));
+    if (amount < 0 || end > (uint64_t)HEAP_START + HEAP_MAX_SIZE) {
+        stop_run(data, IMPS_ERROR, "bad sbrk amount: %" PRIi32, amount);
+    }
+    grow_heap(data, end);
+    data->registers[V0] = data->heap_break;
+    data->heap_break = end;
+}
+
+/**
+ * Checks if access of a particular size of data is valid in existing memory,
+ * the data segment, the heap or the stack. With sparse memory every aligned
+ * access is.
  */
-static void address_check(uint32_t address, struct imps_file *executable, 
-                          int num_bytes) {
-    if (address < MEMORY_START || 
-        address >= MEMORY_START + executable->memory_size + (num_bytes - 1) ||
+static void address_check(struct runtime_data *data, uint32_t address, 
+                          struct imps_file *executable, int num_bytes) {
+    if ((!data->sparse && 
+         (address < MEMORY_START || 
+          address >= MEMORY_START + executable->memory_size + 
+                     (num_bytes - 1)) &&
+         (address < HEAP_START || address >= data->heap_break) &&
+         (address < data->stack_bottom || address >= STACK_TOP)) ||
         address % num_bytes != 0) {
-        fprintf(stderr, "IMPS error: bad address for ");
-        if (num_bytes == BYTE_LEN) {
-            fprintf(stderr, "byte");
-        } else if (num_bytes == HALF_WORD_LEN) {
-            fprintf(stderr, "half");
-        } else {
-            fprintf(stderr, "word");
-        }
-        fprintf(stderr, " access: ");
-        print_uint32_in_hexadecimal(stderr, address);
-        fprintf(stderr, "\n");
-        exit(EXIT_FAILURE);
+        bad_address(data, address, num_bytes);
     } 
 }
 
+/**
+ * Stops the run with the error for a bad access of 'num_bytes' at 'address'.
+ */
+_Noreturn static void bad_address(struct runtime_data *data, uint32_t address,
+                                  int num_bytes) {
+    const char *size = "word";
+    if (num_bytes == BYTE_LEN) {
+        size = "byte";
+    } else if (num_bytes == HALF_WORD_LEN) {
+        size = "half";
+    }
+    stop_run(data, IMPS_ERROR, "bad address for %s access: 0x%08" PRIx32,
+             size, address);
+}
+
+/**
+ * Returns where the 'num_bytes' loaded or, if 'store' is set, stored at 
+ * 'address' are in the memory of the run, stopping with an error if that is
+ * not a valid access. An access to a page in the TLB costs one compare. With
+ * IMPS_GUARD_MEMORY only the alignment is checked here, and the break for
+ * addresses in the committed heap pages, any other address outside the 
+ * data segment faults when it is accessed.
+ */
+static IMPS_ALWAYS_INLINE uint8_t *guest_memory(struct runtime_data *data, 
+                                                uint32_t address, 
+                                                struct imps_file *executable,
+                                                int num_bytes, bool store) {
+#ifdef IMPS_GUARD_MEMORY
+    (void)executable;
+    (void)store;
+    if ((address & (num_bytes - 1)) != 0) {
+        bad_address(data, address, num_bytes);
+    }
+    // The heap is committed in whole host pages, which start a little below
+    // HEAP_START and end a little past the break, so those addresses don't
+    // fault.
+    uint32_t heap_offset = 
+        address - MEMORY_START - (uint32_t)(data->heap - data->memory);
+    if (heap_offset < data->heap_committed && 
+        (address < HEAP_START || 
+         address + num_bytes > data->heap_break) && !data->sparse) {
+        bad_address(data, address, num_bytes);
+    }
+    data->access = (uint64_t)num_bytes << 32 | address;
+    return data->memory + (uint32_t)(address - MEMORY_START);
+#else
+    struct tlb_entry *tlb = store ? data->write_tlb : data->read_tlb;
+    struct tlb_entry *entry = 
+        &tlb[(address >> GUEST_PAGE_SHIFT) & (TLB_LEN - 1)];
+    int size = num_bytes / 2;
+    uint32_t offset = address - entry->base;
+    if ((offset >> size | offset << (-size & 31)) < entry->limits[size]) {
+        return entry->page + offset;
+    }
+    return tlb_miss(data, address, executable, num_bytes, store);
+#endif
+}
+
+#ifndef IMPS_GUARD_MEMORY
+/**
+ * Finds an access that missed the TLB like guest_memory, then enters its 
+ * page in the TLB with the same limits as address_check.
+ */
+static uint8_t *tlb_miss(struct runtime_data *data, uint32_t address, 
+                         struct imps_file *executable, int num_bytes, 
+                         bool store) {
+    address_check(data, address, executable, num_bytes);
+    uint8_t *page = find_page(data, address, store);
+    uint32_t base = address & ~(uint32_t)(GUEST_PAGE_SIZE - 1);
+    // Bytes of the page that are in the data segment, the heap or the stack,
+    // if any. Accesses may start up to one less than their size past the end
+    // of the data segment, but the heap break is always word aligned and the
+    // stack is whole pages.
+    int64_t valid;
+    bool past_end = false;
+    if (data->sparse || base >= data->stack_bottom) {
+        valid = GUEST_PAGE_SIZE;
+    } else if (base >= HEAP_START) {
+        valid = (int64_t)data->heap_break - base;
+    } else {
+        valid = (int64_t)MEMORY_START + executable->memory_size - base;
+        past_end = true;
+    }
+    if (valid > 0) {
+        struct tlb_entry *tlb = store ? data->write_tlb : data->read_tlb;
+        struct tlb_entry *entry = 
+            &tlb[(address >> GUEST_PAGE_SHIFT) & (TLB_LEN - 1)];
+        entry->base = base;
+        entry->page = page;
+        for (int size = 0; size < TLB_SIZES; size++) {
+            int64_t end = valid + (past_end ? (1 << size) - 1 : 0);
+            if (end > GUEST_PAGE_SIZE) {
+                end = GUEST_PAGE_SIZE;
+            }
+            entry->limits[size] = (end + (1 << size) - 1) >> size;
+        }
+    }
+    return page + (address & (GUEST_PAGE_SIZE - 1));
+}
+#endif
+
+/**
+ * Returns the byte at 'address' without checking it. The string syscalls 
+ * read one byte past the last one they check, which is 0 past the end of 
+ * the data segment, the heap or the stack.
+ */
+static uint8_t peek_byte(struct runtime_data *data, uint32_t address, 
+                         struct imps_file *executable) {
+#ifdef IMPS_GUARD_MEMORY
+    uint32_t offset = address - MEMORY_START;
+    if (!data->sparse && offset >= executable->memory_size && 
+        (address < HEAP_START || address >= data->heap_break) &&
+        (address < data->stack_bottom || address >= STACK_TOP)) {
+        return 0;
+    }
+    return data->memory[offset];
+#else
+    (void)executable;
+    return find_page(data, address, false)[address & (GUEST_PAGE_SIZE - 1)];
+#endif
+}
+
+/**
+ * Stands in for a load of 'num_bytes' at 'bytes' into $zero. With 
+ * IMPS_GUARD_MEMORY the last byte is still read so that a bad address faults.
+ */
+static IMPS_ALWAYS_INLINE void discard_load(uint8_t *bytes, int num_bytes) {
+#ifdef IMPS_GUARD_MEMORY
+    (void)((volatile uint8_t *)bytes)[num_bytes - 1];
+#else
+    (void)bytes;
+    (void)num_bytes;
+#endif
+}
+
+// Guest memory is little endian. These move a half word or word with one 
+// host load or store, byte swapped on big-endian hosts. The address has 
+// already been checked by guest_memory, so 'bytes' is aligned in guest 
+// memory, though not necessarily on the host with IMPS_GUARD_MEMORY, which
+// memcpy allows for.
+
+/**
+ * Returns the half word at 'bytes', zero extended.
+ */
+static IMPS_ALWAYS_INLINE uint32_t load_half(uint8_t *bytes) {
+    uint16_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap16(value);
+#endif
+    return value;
+}
+
+/**
+ * Returns the word at 'bytes'.
+ */
+static IMPS_ALWAYS_INLINE uint32_t load_word(uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+/**
+ * Stores the low half word of 'value' at 'bytes'.
+ */
+static IMPS_ALWAYS_INLINE void store_half(uint8_t *bytes, uint32_t value) {
+    uint16_t half = value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    half = __builtin_bswap16(half);
+#endif
+    memcpy(bytes, &half, sizeof(half));
+}
+
+/**
+ * Stores 'value' at 'bytes'.
+ */
+static IMPS_ALWAYS_INLINE void store_word(uint8_t *bytes, uint32_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
 /**
  * Opens a file given a path name. If the file exists then it is assigned
  * the lowest available desciptor. If the file does not exist and is opened
@@ -631,18 +6081,18 @@ static void open_file(struct runtime_data *data, struct file *files,
                       struct imps_file *executable) {
     bool exists = false;
     uint32_t path_address = data->registers[A0];
-    address_check(path_address, executable, BYTE_LEN);
-    int path_index = path_address - MEMORY_START;
+    address_check(data, path_address, executable, BYTE_LEN);
 
     // Get the path name string
-    char ch = 0;
-    char path_name[executable->memory_size];
-    path_name[0] = '\0';
-    while (executable->initial_data[path_index] != '\0') {
-        ch = executable->initial_data[path_index];
-        strncat(path_name, &ch, 1);
-        path_index++;
+    char path_name[MAX_PATH_LEN + 1];
+    int path_len = 0;
+    char ch = peek_byte(data, path_address, executable);
+    while (ch != '\0' && path_len < MAX_PATH_LEN) {
+        path_name[path_len] = ch;
+        path_len++;
+        ch = peek_byte(data, path_address + path_len, executable);
     }
+    path_name[path_len] = '\0';
     // Find the file if it exists and assign lowest descriptor.
     for (int i = 0; i < MAX_FILE_NUM; i++) {
         if (files[i].path != NULL && strcmp(files[i].path, path_name) == 0) {
@@ -694,7 +6144,6 @@ static uint32_t lowest_desc(struct descriptor *descriptors, int i,
 static void read_file(struct runtime_data *data, struct file *files,
                       struct descriptor *descriptors, 
                       struct imps_file *executable) {
-    int buffer_index = data->registers[A1] - MEMORY_START;
     int num_bytes = data->registers[A2];
     uint32_t desc_index = data->registers[A0];
 
@@ -715,8 +6164,7 @@ static void read_file(struct runtime_data *data, struct file *files,
         // Read contents
         int address = data->registers[5];
         for (int i = 0; i < read_size; i++) {
-            address_check(address + i, executable, BYTE_LEN);
-            executable->initial_data[buffer_index + i] = 
+            *guest_memory(data, address + i, executable, BYTE_LEN, true) = 
                 files[descriptors[desc_index].file_index].data[pos + i];
         }
         data->registers[V0] = read_size;
@@ -731,7 +6179,6 @@ static void read_file(struct runtime_data *data, struct file *files,
 static void write_file(struct runtime_data *data, struct file *files,
                        struct descriptor *descriptors, 
                        struct imps_file *executable) {
-    int buffer_index = data->registers[A1] - MEMORY_START;
     int num_bytes = data->registers[A2];
     uint32_t desc_index = data->registers[A0];
 
@@ -749,9 +6196,9 @@ static void write_file(struct runtime_data *data, struct file *files,
         // Write to the file
         int address = data->registers[A1];
         for (int i = 0; i < write_size; i++) {
-            address_check(address + i, executable, BYTE_LEN);
             files[descriptors[desc_index].file_index].data[pos + i] = 
-                executable->initial_data[buffer_index + i];
+                *guest_memory(data, address + i, executable, BYTE_LEN, 
+                              false);
         }
         // Determine new size of the file 
         int file_size = files[descriptors[desc_index].file_index].size;
@@ -789,14 +6236,12 @@ static void close_file(struct runtime_data *data, struct file *files,
  * Adds the source and target register, storing the resulting value in the 
  * destination register. Performs an overflow check.
  */
-static void add_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+static void add_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (destination != ZERO_REGISTER) {
-        overflow_check(registers[target], registers[source]); 
-        registers[destination] = registers[source] + registers[target];
+    if (inst->destination != ZERO_REGISTER) {
+        overflow_check(data, registers[inst->target], registers[inst->source]); 
+        registers[inst->destination] = 
+            registers[inst->source] + registers[inst->target];
     }   
     data->index++; 
 }
@@ -805,21 +6250,19 @@ static void add_inst(uint32_t execute, struct runtime_data *data) {
  * Counts the number of leading one's in the source register, storing the 
  * count in the destination register.
  */
-static void clo_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+static void clo_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
     uint32_t count = 0;
-    if (destination != 0) {
+    if (inst->destination != 0) {
         // Check each bit 
         for (int i = 31; i >= 0; i--) {
-            if (((registers[source] >> i) & 1) == 1) {
+            if (((registers[inst->source] >> i) & 1) == 1) {
                 count++;
             } else {
                 break;
             }
         }
-        registers[destination] = count;
+        registers[inst->destination] = count;
     }
     data->index++;
 }
@@ -828,20 +6271,18 @@ static void clo_inst(uint32_t execute, struct runtime_data *data) {
  * Counts the number of leading zero's in the source register, storing the 
  * count in the destination register.
  */
-static void clz_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+static void clz_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
     uint32_t count = 0;
-    if (destination != 0) {
+    if (inst->destination != 0) {
         for (int i = 31; i >= 0; i--) {
-            if (((registers[source] >> i) & 1) == 0) {
+            if (((registers[inst->source] >> i) & 1) == 0) {
                 count++;
             } else {
                 break;
             }
         }
-        registers[destination] = count;
+        registers[inst->destination] = count;
     }
     data->index++;
 }
@@ -850,14 +6291,11 @@ static void clz_inst(uint32_t execute, struct runtime_data *data) {
  * Adds the source and target register, storing the resulting value in the 
  * destination register.
  */
-static void addu_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+static void addu_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (destination != ZERO_REGISTER) {
-        registers[destination] = registers[source] + registers[target];
-   
+    if (inst->destination != ZERO_REGISTER) {
+        registers[inst->destination] = 
+            registers[inst->source] + registers[inst->target];
     }   
     data->index++; 
 }
@@ -867,16 +6305,13 @@ static void addu_inst(uint32_t execute, struct runtime_data *data) {
  * is greater than the source register, 1 is stored in the destination register,
  * else 0.
  */
-static void slt_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
+static void slt_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (destination != ZERO_REGISTER) {
-        if ((int)registers[source] < (int)registers[target]) {
-            registers[destination] = 1;
+    if (inst->destination != ZERO_REGISTER) {
+        if ((int)registers[inst->source] < (int)registers[inst->target]) {
+            registers[inst->destination] = 1;
         } else {
-            registers[destination] = 0;
+            registers[inst->destination] = 0;
         }
     }   
     data->index++; 
@@ -886,27 +6321,19 @@ static void slt_inst(uint32_t execute, struct runtime_data *data) {
  * If the given opcode and funct do not correspond to any implemented 
  * instruction, then an error is printed.
  */
-static void print_bad_instruction(uint32_t execute, struct runtime_data *data,
-                                  struct file *files,
-                                  struct descriptor *descriptors) {
-    fprintf(stderr, "IMPS error: bad instruction ");
-    print_uint32_in_hexadecimal(stderr, execute);
-    fprintf(stderr, "\n");
-    free_data(data, files, descriptors);
-    exit(EXIT_FAILURE); 
+static void print_bad_instruction(uint32_t execute, 
+                                  struct runtime_data *data) {
+    stop_run(data, IMPS_ERROR, "bad instruction 0x%08" PRIx32, execute);
 }
 
 /**
  * Performs the bitwise operation OR between the source and immediate values,
  * storing the result in the target register.
  */
-static void ori_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint16_t immediate = execute & IMMEDIATE_MASK;
+static void ori_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (target != ZERO_REGISTER) {
-        registers[target] = registers[source] | immediate;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = registers[inst->source] | inst->immediate;
     }
     data->index++;   
 }
@@ -914,15 +6341,10 @@ static void ori_inst(uint32_t execute, struct runtime_data *data) {
 /**
  * Loads the immediate value into the top 16 bits of the target register.
  */
-static void lui_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t immediate = execute & IMMEDIATE_MASK;
-    if ((immediate >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        immediate -= SIGN_BIT_EXTENSION;
-    }
+static void lui_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (target != ZERO_REGISTER) {
-        registers[target] = immediate << LUI_SHIFT;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = inst->immediate;
     }
     data->index++;
 }
@@ -931,16 +6353,10 @@ static void lui_inst(uint32_t execute, struct runtime_data *data) {
  * Stores the sum value of a register and an immediate value in the target 
  * register. 
  */
-static void addiu_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t immediate = execute & IMMEDIATE_MASK;
-    if ((immediate >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        immediate -= SIGN_BIT_EXTENSION;
-    }
+static void addiu_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (target != ZERO_REGISTER) {
-        registers[target] = registers[source] + immediate;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = registers[inst->source] + inst->immediate;
     }   
     data->index++;
 }
@@ -949,14 +6365,11 @@ static void addiu_inst(uint32_t execute, struct runtime_data *data) {
  * Stores the product of the source and target register in the destination
  * register.
  */
-static void mul_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint8_t destination = (execute >> DESTINATION_SHIFT) & REGISTER_MASK;
-
+static void mul_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (destination != ZERO_REGISTER) {
-        registers[destination] = registers[source] * registers[target];
+    if (inst->destination != ZERO_REGISTER) {
+        registers[inst->destination] = 
+            registers[inst->source] * registers[inst->target];
     }   
     data->index++; 
 }
@@ -965,16 +6378,10 @@ static void mul_inst(uint32_t execute, struct runtime_data *data) {
  * Checks if the value in two registers is equal, if so, jumps to the next
  * instruction with a given offset.
  */
-static void beq_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
+static void beq_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (registers[source] == registers[target]) {
-        data->index += offset;
+    if (registers[inst->source] == registers[inst->target]) {
+        data->index += inst->immediate;
     } else {
         data->index++;
     }
@@ -984,70 +6391,33 @@ static void beq_inst(uint32_t execute, struct runtime_data *data) {
  * Checks if the value in two registers are not equal, if so, jumps to the next
  * instruction with a given offset.
  */
-static void bne_inst(uint32_t execute, struct runtime_data *data) {
-    uint8_t source = (execute >> SOURCE_SHIFT) & REGISTER_MASK;
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
+static void bne_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    if (registers[source] != registers[target]) {
-        data->index += offset;
+    if (registers[inst->source] != registers[inst->target]) {
+        data->index += inst->immediate;
     } else {
         data->index++;
     }
 }
 
-/**
- * Function that checks the opcode and executes all memory related instructions.
- * If the opcode is not valid, then an error is printed.
- */
-static void mem_inst(uint32_t execute, struct runtime_data *data,
-                     struct imps_file *executable, struct file *files,
-                     struct descriptor *descriptors) {
-    uint8_t opcode = (execute >> OPCODE_SHIFT) & OPCODE_MASK;
-
-    if (opcode == LB_INST) {
-        lb_inst(execute, data, executable);
-    } else if (opcode == LH_INST) {
-        lh_inst(execute, data, executable);
-    } else if (opcode == LW_INST) {
-        lw_inst(execute, data, executable);
-    } else if (opcode == SB_INST) {
-        sb_inst(execute, data, executable);
-    } else if (opcode == SH_INST) {
-        sh_inst(execute, data, executable);
-    } else if (opcode == SW_INST) {
-        sw_inst(execute, data, executable);
-    } else {
-        print_bad_instruction(execute, data, files, descriptors);
-    }
-}
-
 /**
  * Loads a byte from a given valid memory address into the target register.
  */
-static void lb_inst(uint32_t execute, struct runtime_data *data,
+static void lb_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, BYTE_LEN);
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = guest_memory(data, address, executable, BYTE_LEN, false);
 
-    int index = address - MEMORY_START;
-    if (target != ZERO_REGISTER) {
+    if (inst->target != ZERO_REGISTER) {
         uint32_t mem_extract = 0;
-        mem_extract = executable->initial_data[index];
+        mem_extract = bytes[0];
         if ((mem_extract >> UINT8_SHIFT) & SIGN_BIT_MASK) {
             mem_extract -= UINT8_EXTENSION;
         }
-        registers[target] = mem_extract;
+        registers[inst->target] = mem_extract;
+    } else {
+        discard_load(bytes, BYTE_LEN);
     }
     data->index++;
 }
@@ -1055,29 +6425,17 @@ static void lb_inst(uint32_t execute, struct runtime_data *data,
 /**
  * Loads a half word from a given valid memory address into the target register.
  */
-static void lh_inst(uint32_t execute, struct runtime_data *data,
+static void lh_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, HALF_WORD_LEN);
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = 
+        guest_memory(data, address, executable, HALF_WORD_LEN, false);
 
-    int index = address - MEMORY_START;
-    if (target != ZERO_REGISTER) {
-        uint32_t mem_extract = 0;
-        for (int i = 0; i < HALF_WORD_LEN; i++) {
-            mem_extract |= 
-                executable->initial_data[index + i] << (BYTE_SIZE * i);
-        }
-        if ((mem_extract >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-            mem_extract -= SIGN_BIT_EXTENSION;
-        }
-        registers[target] = mem_extract;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = sign_extend(load_half(bytes));
+    } else {
+        discard_load(bytes, HALF_WORD_LEN);
     }
     data->index++;
 }
@@ -1085,26 +6443,16 @@ static void lh_inst(uint32_t execute, struct runtime_data *data,
 /**
  * Loads a word from a given valid memory address into the target register.
  */
-static void lw_inst(uint32_t execute, struct runtime_data *data,
+static void lw_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }  
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, WORD_LEN);  
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = guest_memory(data, address, executable, WORD_LEN, false);
 
-    int index = address - MEMORY_START;
-    if (target != ZERO_REGISTER) {
-        uint32_t mem_extract = 0;
-        for (int i = 0; i < WORD_LEN; i++) {
-            mem_extract |= 
-                executable->initial_data[index + i] << (BYTE_SIZE * i);
-        }
-        registers[target] = mem_extract;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = load_word(bytes);
+    } else {
+        discard_load(bytes, WORD_LEN);
     }
     data->index++;      
 }
@@ -1112,69 +6460,123 @@ static void lw_inst(uint32_t execute, struct runtime_data *data,
 /**
  * Saves a byte from the target register to a valid memory address.
  */
-static void sb_inst(uint32_t execute, struct runtime_data *data,
+static void sb_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, BYTE_LEN);
-
-    int index = address - MEMORY_START;
-    executable->initial_data[index] = registers[target];
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = guest_memory(data, address, executable, BYTE_LEN, true);
+    bytes[0] = registers[inst->target];
     data->index++;
 }
 
 /**
  * Saves a half word from the target register to a valid memory address.
  */
-static void sh_inst(uint32_t execute, struct runtime_data *data,
+static void sh_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
-    }
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, HALF_WORD_LEN);
-
-    int index = address - MEMORY_START;
-    for (int i = 0; i < HALF_WORD_LEN; i++) {
-        executable->initial_data[index + i] = (registers[target] >> 
-            (BYTE_SIZE * i)) & UINT8_MASK;
-    }
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = 
+        guest_memory(data, address, executable, HALF_WORD_LEN, true);
+    store_half(bytes, registers[inst->target]);
     data->index++;
 }
 
 /**
  * Saves a word from the target register to a valid memory address.
  */
-static void sw_inst(uint32_t execute, struct runtime_data *data,
+static void sw_inst(struct decoded_inst *inst, struct runtime_data *data,
                     struct imps_file *executable) {
-    uint8_t base = (execute >> BASE_SHIFT) & REGISTER_MASK;                    
-    uint8_t target = (execute >> TARGET_SHIFT) & REGISTER_MASK;
-    uint32_t offset = execute & OFFSET_MASK;
-    if ((offset >> SIGN_BIT_SHIFT) & SIGN_BIT_MASK) {
-        offset -= SIGN_BIT_EXTENSION;
+    uint32_t *registers = data->registers;
+    uint32_t address = registers[inst->source] + inst->immediate;
+    uint8_t *bytes = guest_memory(data, address, executable, WORD_LEN, true);
+    store_word(bytes, registers[inst->target]);
+    data->index++;
+}
+
+/**
+ * Superinstruction for lui followed by ori, the expansion of li and la.
+ */
+static void lui_ori_inst(struct decoded_inst *inst, struct runtime_data *data) {
+    uint32_t *registers = data->registers;
+    struct decoded_inst *ori = inst + 1;
+    if (inst->target != ZERO_REGISTER) {
+        registers[inst->target] = inst->immediate;
     }
+    if (ori->target != ZERO_REGISTER) {
+        registers[ori->target] = registers[ori->source] | ori->immediate;
+    }
+    data->index += 2;
+}
+
+/**
+ * Superinstruction for slt followed by beq, the expansion of bge.
+ */
+static void slt_beq_inst(struct decoded_inst *inst, struct runtime_data *data) {
     uint32_t *registers = data->registers;
-    uint32_t address = registers[base] + offset;
-    address_check(address, executable, WORD_LEN);
+    struct decoded_inst *beq = inst + 1;
+    if (inst->destination != ZERO_REGISTER) {
+        registers[inst->destination] = 
+            (int)registers[inst->source] < (int)registers[inst->target];
+    }
+    if (registers[beq->source] == registers[beq->target]) {
+        data->index += 1 + beq->immediate;
+    } else {
+        data->index += 2;
+    }
+}
 
-    int index = address - MEMORY_START;
-    for (int i = 0; i < WORD_LEN; i++) {
-        executable->initial_data[index + i] = (registers[target] >> 
-            (BYTE_SIZE * i)) & UINT8_MASK;
+/**
+ * Superinstruction for slt followed by bne, the expansion of blt.
+ */
+static void slt_bne_inst(struct decoded_inst *inst, struct runtime_data *data) {
+    uint32_t *registers = data->registers;
+    struct decoded_inst *bne = inst + 1;
+    if (inst->destination != ZERO_REGISTER) {
+        registers[inst->destination] = 
+            (int)registers[inst->source] < (int)registers[inst->target];
+    }
+    if (registers[bne->source] != registers[bne->target]) {
+        data->index += 1 + bne->immediate;
+    } else {
+        data->index += 2;
+    }
+}
+
+/**
+ * Superinstruction for addi followed by bne, the usual loop counter update
+ * and test.
+ */
+static void addi_bne_inst(struct decoded_inst *inst, 
+                          struct runtime_data *data) {
+    uint32_t *registers = data->registers;
+    struct decoded_inst *bne = inst + 1;
+    if (inst->target != ZERO_REGISTER) {
+        overflow_check(data, inst->immediate, registers[inst->source]);
+        registers[inst->target] = registers[inst->source] + inst->immediate;
+    }
+    if (registers[bne->source] != registers[bne->target]) {
+        data->index += 1 + bne->immediate;
+    } else {
+        data->index += 2;
     }
-    data->index++;
 }
 
+// Generated superinstructions run each of their parts in turn.
+#define FUSED_DEFINITION(name, length, a, b, c, d) \
+    static void fused_##name##_inst(struct decoded_inst *inst, \
+                                    struct runtime_data *data, \
+                                    struct imps_file *executable) { \
+        (void)executable; \
+        FUSED_PART_##a(0); \
+        FUSED_PART_##b(1); \
+        FUSED_PART_##c(2); \
+        FUSED_PART_##d(3); \
+    }
+GENERATED_SUPERINSTRUCTIONS(FUSED_DEFINITION)
+#undef FUSED_DEFINITION
+
+#ifndef IMPS_LIBRARY
 /**
  * Checks and prints out any changes of values in registers. Used for tracing
  * in subset 4. 
@@ -1220,6 +6622,7 @@ static void print_modified(struct runtime_data *data) {
         putchar('\n');
     }
 }
+#endif
 
 // Printing out exact-width integers in a portable way is slightly tricky,
 // since we can't assume that a uint32_t is an unsigned int or that a
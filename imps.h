@@ -0,0 +1,118 @@
+////////////////////////////////////////////////////////////////////////
+// libimps: the `imps' MIPS emulator as a library
+//
+// Build "MIPS Emulator.c" with -DIMPS_LIBRARY to leave out its main function
+// and link it into another program. Nothing in the library exits the
+// process: every function reports failure through its return value, with a
+// message from imps_vm_message, so one process can run any number of guest
+// programs one after the other.
+
+#ifndef IMPS_H
+#define IMPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Results of loading and running a program.
+enum imps_status {
+    // The call succeeded.
+    IMPS_OK,
+    // The program ran the exit syscall.
+    IMPS_EXITED,
+    // The program can run (further) with imps_vm_run.
+    IMPS_RUNNING,
+    // The program stopped with a runtime error, e.g. a bad address.
+    IMPS_ERROR,
+    // The buffer given to imps_vm_load_buffer is not a valid executable, or
+    // no program has been loaded.
+    IMPS_INVALID,
+    // Memory for the program could not be allocated.
+    IMPS_NO_MEMORY
+};
+
+// Called with the bytes the program prints.
+typedef void (*imps_write_fn)(void *context, const char *bytes,
+                              size_t length);
+
+// Called when the program reads a character. Returns the next byte of input
+// or -1 at the end of the input.
+typedef int (*imps_read_fn)(void *context);
+
+// An emulator instance holding one program and its registers, memory and
+// files. Instances share nothing that they write to, so different threads 
+// can run different instances at the same time.
+struct imps_vm;
+
+// The registers, memory and files of an instance at one point of its run,
+// from which any number of new instances can be forked.
+struct imps_snapshot;
+
+/**
+ * Returns a new instance with no program loaded, reading stdin and writing
+ * stdout, or NULL if it can't be allocated.
+ */
+struct imps_vm *imps_vm_create(void);
+
+/**
+ * Loads the IMPS executable in the 'length' bytes at 'buffer', replacing any
+ * program already loaded. The buffer is copied and can be reused straight
+ * away. Returns IMPS_OK, IMPS_INVALID or IMPS_NO_MEMORY.
+ */
+int imps_vm_load_buffer(struct imps_vm *vm, const void *buffer,
+                        size_t length);
+
+/**
+ * Sends the program's output to 'write' and takes its input from 'read',
+ * both called with 'context'.
+ */
+void imps_vm_set_io(struct imps_vm *vm, imps_write_fn write,
+                    imps_read_fn read, void *context);
+
+/**
+ * Runs the loaded program until it exits or fails, or, if 'budget' is not 0,
+ * until it has run about 'budget' instructions. The budget is checked
+ * between basic blocks, so a run can go over it by the length of one block.
+ * Returns IMPS_EXITED, IMPS_ERROR, IMPS_RUNNING if the budget ran out, 
+ * IMPS_NO_MEMORY if memory for running it could not be allocated, or
+ * IMPS_INVALID if no program is loaded. After IMPS_NO_MEMORY the next call
+ * tries again from where the run stopped. Once the program has exited or
+ * failed, further calls return the same result.
+ */
+int imps_vm_run(struct imps_vm *vm, uint64_t budget);
+
+/**
+ * Returns a description of the last IMPS_ERROR or IMPS_INVALID result, such
+ * as "bad address for word access: 0x00000000". The string is owned by the
+ * instance and stays valid until its next call.
+ */
+const char *imps_vm_message(struct imps_vm *vm);
+
+/**
+ * Frees an instance and everything it holds.
+ */
+void imps_vm_destroy(struct imps_vm *vm);
+
+/**
+ * Captures the state of an instance that has a program loaded and has not
+ * exited or failed, for example after a run stopped by its budget. The 
+ * snapshot does not change when the instance goes on running. Returns NULL
+ * if there is nothing to capture or no memory for it.
+ */
+struct imps_snapshot *imps_vm_snapshot(struct imps_vm *vm);
+
+/**
+ * Returns a new instance that carries on from 'snapshot' with the same 
+ * options and input and output callbacks as the instance it was taken from,
+ * or NULL if it can't be allocated. Forks share the snapshot's program and,
+ * on unix hosts, its memory a page at a time until they write to it, so 
+ * forking is much cheaper than loading the program again. A snapshot can be
+ * forked from several threads at once.
+ */
+struct imps_vm *imps_vm_fork(struct imps_snapshot *snapshot);
+
+/**
+ * Frees a snapshot. Instances forked from it are not affected.
+ */
+void imps_snapshot_destroy(struct imps_snapshot *snapshot);
+
+#endif